@@ -0,0 +1,198 @@
+#include "batch.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct Query {
+  uint64_t k;
+  uint64_t mod;
+  uint64_t result;
+};
+
+struct Segment {
+  uint64_t mod;
+  uint64_t begin;
+  uint64_t end;
+  struct Query **queries; // sorted by k, all within [begin, end]
+  size_t nqueries;
+  uint64_t product; // of the whole segment
+};
+
+static int CompareQueries(const void *a, const void *b) {
+  const struct Query *x = *(struct Query *const *)a;
+  const struct Query *y = *(struct Query *const *)b;
+  if (x->mod != y->mod)
+    return x->mod < y->mod ? -1 : 1;
+  if (x->k != y->k)
+    return x->k < y->k ? -1 : 1;
+  return 0;
+}
+
+// Running product over the segment; each query gets the product from the
+// segment start up to its k, the prefix before the segment is applied later.
+static void *SweepSegment(void *arg) {
+  struct Segment *seg = arg;
+  uint64_t acc = 1 % seg->mod;
+  uint64_t pos = seg->begin;
+  for (size_t i = 0; i < seg->nqueries; i++) {
+    struct Query *q = seg->queries[i];
+    if (q->k >= pos) {
+      acc = MulMod(acc, RangeProductMod(pos, q->k, seg->mod), seg->mod);
+      pos = q->k + 1;
+    }
+    q->result = acc;
+  }
+  if (pos <= seg->end)
+    acc = MulMod(acc, RangeProductMod(pos, seg->end, seg->mod), seg->mod);
+  seg->product = acc;
+  return NULL;
+}
+
+// Whether answering queries[0..n) one by one with FactorialModPrime is
+// estimated to beat a sweep over [1, kmax] split across pnum threads.
+static bool FastIsCheaper(struct Query **queries, size_t n, uint64_t kmax,
+                          int pnum) {
+  uint64_t sweep = kmax / (uint64_t)pnum, fast = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t cost = FactorialModPrimeCost(queries[i]->k, queries[i]->mod);
+    if (cost >= sweep - fast)
+      return false;
+    fast += cost;
+  }
+  return true;
+}
+
+// Answers queries[0..n), all sharing one modulus and sorted by k.
+static void SweepGroup(struct Query **queries, size_t n, int pnum,
+                       enum FactAlgo algo) {
+  uint64_t mod = queries[0]->mod;
+  size_t first = 0;
+  while (first < n && queries[first]->k <= 1)
+    queries[first++]->result = 1 % mod;
+  size_t last = n;
+  while (last > first && queries[last - 1]->k >= mod)
+    queries[--last]->result = 0;
+  if (first == last)
+    return;
+
+  // Against a prime, queries are answered one by one when that costs less
+  // than the sweep. A composite modulus always takes the sweep, even with
+  // --algo=fast.
+  uint64_t kmax = queries[last - 1]->k;
+  if (FactUseFast(kmax, mod, algo) &&
+      (algo == FACT_ALGO_FAST ||
+       FastIsCheaper(queries + first, last - first, kmax, pnum))) {
+    for (size_t i = first; i < last; i++)
+      queries[i]->result = FactorialModPrime(queries[i]->k, mod);
+    return;
+  }
+
+  if ((uint64_t)pnum > kmax)
+    pnum = (int)kmax;
+  struct Segment segs[pnum];
+  pthread_t threads[pnum];
+  uint64_t begin = 1;
+  size_t qi = first;
+  for (int t = 0; t < pnum; t++) {
+    uint64_t len = kmax / pnum + ((uint64_t)t < kmax % pnum ? 1 : 0);
+    segs[t].mod = mod;
+    segs[t].begin = begin;
+    segs[t].end = begin + len - 1;
+    segs[t].queries = queries + qi;
+    segs[t].nqueries = 0;
+    while (qi < last && queries[qi]->k <= segs[t].end) {
+      qi++;
+      segs[t].nqueries++;
+    }
+    begin += len;
+    if (pthread_create(&threads[t], NULL, SweepSegment, &segs[t]) != 0) {
+      perror("pthread_create failed");
+      exit(1);
+    }
+  }
+
+  uint64_t prefix = 1 % mod;
+  for (int t = 0; t < pnum; t++) {
+    pthread_join(threads[t], NULL);
+    for (size_t i = 0; i < segs[t].nqueries; i++)
+      segs[t].queries[i]->result =
+          MulMod(prefix, segs[t].queries[i]->result, mod);
+    prefix = MulMod(prefix, segs[t].product, mod);
+  }
+}
+
+int RunBatch(FILE *in, int pnum, enum FactAlgo algo) {
+  size_t n = 0, capacity = 1024;
+  struct Query *queries = malloc(capacity * sizeof(struct Query));
+  if (queries == NULL) {
+    printf("Error: memory allocation failed\n");
+    return 1;
+  }
+
+  unsigned long long k, mod;
+  int matched;
+  while ((matched = fscanf(in, "%llu %llu", &k, &mod)) == 2) {
+    if (mod == 0) {
+      printf("Error: query %zu has zero modulus\n", n + 1);
+      free(queries);
+      return 1;
+    }
+    if (n == capacity) {
+      capacity *= 2;
+      struct Query *grown = realloc(queries, capacity * sizeof(struct Query));
+      if (grown == NULL) {
+        printf("Error: memory allocation failed\n");
+        free(queries);
+        return 1;
+      }
+      queries = grown;
+    }
+    queries[n++] = (struct Query){k, mod, 0};
+  }
+  if (matched != EOF) {
+    printf("Error: malformed query after line %zu\n", n);
+    free(queries);
+    return 1;
+  }
+
+  struct timespec start, finish;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct Query **order = malloc((n + 1) * sizeof(struct Query *));
+  if (order == NULL) {
+    printf("Error: memory allocation failed\n");
+    free(queries);
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++)
+    order[i] = &queries[i];
+  qsort(order, n, sizeof(struct Query *), CompareQueries);
+  size_t groups = 0;
+  for (size_t g = 0; g < n;) {
+    size_t h = g;
+    while (h < n && order[h]->mod == order[g]->mod)
+      h++;
+    SweepGroup(order + g, h - g, pnum, algo);
+    groups++;
+    g = h;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    printf("%llu %llu %llu\n", (unsigned long long)queries[i].k,
+           (unsigned long long)queries[i].mod,
+           (unsigned long long)queries[i].result);
+  fflush(stdout);
+
+  clock_gettime(CLOCK_MONOTONIC, &finish);
+  double seconds = (finish.tv_sec - start.tv_sec) +
+                   (finish.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "Batch: %zu queries, %zu moduli, %.3fms (%.2f queries/sec)\n",
+          n, groups, seconds * 1000.0, seconds > 0 ? (double)n / seconds : 0.0);
+
+  free(order);
+  free(queries);
+  return 0;
+}
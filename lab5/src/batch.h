@@ -0,0 +1,14 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+#include "factmod.h"
+
+// Reads "k mod" pairs (one per line) from in and prints "k mod k!%mod" for
+// each of them in input order. Queries are grouped by modulus and every
+// group is answered by one sweep over [1, max k] split across pnum threads.
+// Returns 0 on success.
+int RunBatch(FILE *in, int pnum, enum FactAlgo algo);
+
+#endif
@@ -0,0 +1,185 @@
+#include "bigfact.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Subtree {
+  uint64_t begin;
+  uint64_t end; // inclusive
+  struct BigNum result;
+};
+
+struct Merge {
+  struct BigNum *left;
+  struct BigNum *right;
+  struct BigNum result;
+};
+
+// Product of leaves[lo..hi) by recursive halving, so operands stay balanced.
+static void TreeProduct(const uint64_t *leaves, size_t lo, size_t hi,
+                        struct BigNum *out) {
+  if (hi - lo == 1) {
+    BigSetU64(out, leaves[lo], BIG_BASE_BIN);
+    return;
+  }
+  size_t mid = lo + (hi - lo) / 2;
+  struct BigNum left, right;
+  BigInit(&left);
+  BigInit(&right);
+  TreeProduct(leaves, lo, mid, &left);
+  TreeProduct(leaves, mid, hi, &right);
+  BigMul(out, &left, &right, BIG_BASE_BIN);
+  BigFree(&right);
+  BigFree(&left);
+}
+
+static uint64_t *ResizeLeaves(uint64_t *leaves, size_t cap) {
+  uint64_t *grown = realloc(leaves, cap * sizeof(uint64_t));
+  if (grown == NULL) {
+    fprintf(stderr, "bigfact: out of memory\n");
+    exit(1);
+  }
+  return grown;
+}
+
+// Packs the odd parts of begin..end into 64-bit leaves, then multiplies the
+// leaves with the product tree.
+static void *ComputeSubtree(void *arg) {
+  struct Subtree *sub = arg;
+  size_t n = 0, cap = 1024;
+  uint64_t *leaves = ResizeLeaves(NULL, cap);
+  uint64_t acc = 1;
+  for (uint64_t i = sub->begin; i <= sub->end; i++) {
+    uint64_t odd = i >> __builtin_ctzll(i);
+    if (odd == 1)
+      continue;
+    if ((unsigned __int128)acc * odd > UINT64_MAX) {
+      if (n == cap) {
+        cap *= 2;
+        leaves = ResizeLeaves(leaves, cap);
+      }
+      leaves[n++] = acc;
+      acc = 1;
+    }
+    acc *= odd;
+  }
+  if (n == cap)
+    leaves = ResizeLeaves(leaves, cap + 1);
+  leaves[n++] = acc;
+
+  TreeProduct(leaves, 0, n, &sub->result);
+  free(leaves);
+  return NULL;
+}
+
+// Smallest x with log(x!) >= share * log(k!), via Stirling's x ln x - x.
+static uint64_t SplitPoint(uint64_t k, double share) {
+  double target = share * ((double)k * log((double)k) - (double)k);
+  uint64_t lo = 1, hi = k;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if ((double)mid * log((double)mid) - (double)mid >= target)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+static void *ComputeMerge(void *arg) {
+  struct Merge *merge = arg;
+  BigMul(&merge->result, merge->left, merge->right, BIG_BASE_BIN);
+  return NULL;
+}
+
+void ExactFactorial(uint64_t k, int pnum, struct BigNum *out) {
+  if (k < 2) {
+    BigSetU64(out, 1, BIG_BASE_BIN);
+    return;
+  }
+  if ((uint64_t)pnum > k / 2)
+    pnum = k / 2 > 0 ? (int)(k / 2) : 1;
+
+  // Later ranges hold larger numbers, so every thread gets an equal share
+  // of the result's bits rather than an equal count of factors.
+  struct Subtree subs[pnum];
+  pthread_t threads[pnum];
+  uint64_t begin = 1;
+  for (int t = 0; t < pnum; t++) {
+    uint64_t end = t == pnum - 1 ? k : SplitPoint(k, (double)(t + 1) / pnum);
+    if (end < begin)
+      end = begin;
+    subs[t].begin = begin;
+    subs[t].end = end;
+    BigInit(&subs[t].result);
+    begin = end + 1;
+    if (subs[t].begin > k) {
+      BigSetU64(&subs[t].result, 1, BIG_BASE_BIN);
+      threads[t] = 0;
+    } else if (pthread_create(&threads[t], NULL, ComputeSubtree, &subs[t])) {
+      perror("pthread_create failed");
+      exit(1);
+    }
+  }
+  for (int t = 0; t < pnum; t++) {
+    if (threads[t] != 0)
+      pthread_join(threads[t], NULL);
+  }
+
+  // Pairwise rounds: each round halves the number of partial products and
+  // runs its multiplications concurrently.
+  struct BigNum *parts = malloc(pnum * sizeof(struct BigNum));
+  int nparts = pnum;
+  for (int t = 0; t < pnum; t++)
+    parts[t] = subs[t].result;
+  while (nparts > 1) {
+    int pairs = nparts / 2;
+    struct Merge merges[pairs];
+    pthread_t merge_threads[pairs];
+    for (int i = 0; i < pairs; i++) {
+      merges[i].left = &parts[2 * i];
+      merges[i].right = &parts[2 * i + 1];
+      BigInit(&merges[i].result);
+      if (pthread_create(&merge_threads[i], NULL, ComputeMerge, &merges[i])) {
+        perror("pthread_create failed");
+        exit(1);
+      }
+    }
+    for (int i = 0; i < pairs; i++) {
+      pthread_join(merge_threads[i], NULL);
+      BigFree(merges[i].left);
+      BigFree(merges[i].right);
+      parts[i] = merges[i].result;
+    }
+    if (nparts % 2)
+      parts[pairs] = parts[nparts - 1];
+    nparts = pairs + nparts % 2;
+  }
+
+  BigCopy(out, &parts[0]);
+  BigFree(&parts[0]);
+  free(parts);
+
+  // Each i contributes ctz(i) twos; summed over 1..k that is k - popcount(k).
+  BigShiftLeft(out, k - __builtin_popcountll(k));
+}
+
+void ExactFactorialNaive(uint64_t k, struct BigNum *out) {
+  BigSetU64(out, 1, BIG_BASE_BIN);
+  for (uint64_t i = 2; i <= k; i++) {
+    if (i <= UINT32_MAX) {
+      BigMulSmall(out, (uint32_t)i, 0, BIG_BASE_BIN);
+    } else {
+      struct BigNum factor, product;
+      BigInit(&factor);
+      BigInit(&product);
+      BigSetU64(&factor, i, BIG_BASE_BIN);
+      BigMul(&product, out, &factor, BIG_BASE_BIN);
+      BigCopy(out, &product);
+      BigFree(&product);
+      BigFree(&factor);
+    }
+  }
+}
@@ -0,0 +1,17 @@
+#ifndef BIGFACT_H
+#define BIGFACT_H
+
+#include <stdint.h>
+
+#include "bignum.h"
+
+// Exact k! in binary limbs. The odd parts of 1..k are multiplied with a
+// balanced product tree, one subtree per thread (up to pnum) and the
+// subtree results merged pairwise in parallel; the k - popcount(k) factors
+// of two are applied as a single shift at the end.
+void ExactFactorial(uint64_t k, int pnum, struct BigNum *out);
+
+// Left-to-right 1 * 2 * ... * k, for comparison.
+void ExactFactorialNaive(uint64_t k, struct BigNum *out);
+
+#endif
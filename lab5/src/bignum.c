@@ -0,0 +1,352 @@
+#include "bignum.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntt.h"
+
+#define KARATSUBA_THRESHOLD 48
+#define NTT_THRESHOLD 1024
+#define DECIMAL_LEAF 64
+
+static void *CheckedAlloc(size_t size) {
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) {
+    fprintf(stderr, "bignum: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static void Reserve(struct BigNum *x, size_t cap) {
+  if (x->cap >= cap)
+    return;
+  size_t grown = x->cap * 2 > cap ? x->cap * 2 : cap;
+  uint32_t *limb = realloc(x->limb, grown * sizeof(uint32_t));
+  if (limb == NULL) {
+    fprintf(stderr, "bignum: out of memory\n");
+    exit(1);
+  }
+  x->limb = limb;
+  x->cap = grown;
+}
+
+static size_t Trim(const uint32_t *limb, size_t len) {
+  while (len > 0 && limb[len - 1] == 0)
+    len--;
+  return len;
+}
+
+void BigInit(struct BigNum *x) { memset(x, 0, sizeof(*x)); }
+
+void BigFree(struct BigNum *x) {
+  free(x->limb);
+  BigInit(x);
+}
+
+void BigSetU64(struct BigNum *x, uint64_t value, uint64_t base) {
+  x->len = 0;
+  while (value > 0) {
+    Reserve(x, x->len + 1);
+    x->limb[x->len++] = (uint32_t)(value % base);
+    value /= base;
+  }
+}
+
+void BigCopy(struct BigNum *dst, const struct BigNum *src) {
+  Reserve(dst, src->len);
+  if (src->len > 0)
+    memcpy(dst->limb, src->limb, src->len * sizeof(uint32_t));
+  dst->len = src->len;
+}
+
+void BigMulSmall(struct BigNum *x, uint32_t m, uint32_t add, uint64_t base) {
+  uint64_t carry = add;
+  for (size_t i = 0; i < x->len; i++) {
+    uint64_t t = (uint64_t)x->limb[i] * m + carry;
+    x->limb[i] = (uint32_t)(t % base);
+    carry = t / base;
+  }
+  while (carry > 0) {
+    Reserve(x, x->len + 1);
+    x->limb[x->len++] = (uint32_t)(carry % base);
+    carry /= base;
+  }
+  x->len = Trim(x->limb, x->len);
+}
+
+/* --- Raw limb kernels ------------------------------------------------------ */
+
+// r[0..rn) += a[0..an), rn > an; returns the carry out of r.
+static uint32_t AddInto(uint32_t *r, size_t rn, const uint32_t *a, size_t an,
+                        uint64_t base) {
+  uint64_t carry = 0;
+  size_t i = 0;
+  for (; i < an; i++) {
+    uint64_t t = (uint64_t)r[i] + a[i] + carry;
+    carry = t >= base;
+    r[i] = (uint32_t)(carry ? t - base : t);
+  }
+  for (; carry && i < rn; i++) {
+    uint64_t t = (uint64_t)r[i] + 1;
+    carry = t >= base;
+    r[i] = (uint32_t)(carry ? t - base : t);
+  }
+  return (uint32_t)carry;
+}
+
+// r[0..rn) -= a[0..an), requires r >= a.
+static void SubFrom(uint32_t *r, size_t rn, const uint32_t *a, size_t an,
+                    uint64_t base) {
+  int64_t borrow = 0;
+  size_t i = 0;
+  for (; i < an; i++) {
+    int64_t t = (int64_t)r[i] - a[i] - borrow;
+    borrow = t < 0;
+    r[i] = (uint32_t)(borrow ? t + (int64_t)base : t);
+  }
+  for (; borrow && i < rn; i++) {
+    int64_t t = (int64_t)r[i] - 1;
+    borrow = t < 0;
+    r[i] = (uint32_t)(borrow ? t + (int64_t)base : t);
+  }
+}
+
+static void Schoolbook(const uint32_t *a, size_t na, const uint32_t *b,
+                       size_t nb, uint32_t *r, uint64_t base) {
+  memset(r, 0, (na + nb) * sizeof(uint32_t));
+  for (size_t i = 0; i < na; i++) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < nb; j++) {
+      uint64_t t = (uint64_t)a[i] * b[j] + r[i + j] + carry;
+      r[i + j] = (uint32_t)(t % base);
+      carry = t / base;
+    }
+    r[i + nb] = (uint32_t)carry;
+  }
+}
+
+// Exact cyclic convolution via three primes; limbs are below 2^32 and the
+// shorter operand below 2^22 limbs, so every coefficient stays under 2^86.
+static void NttMul(const uint32_t *a, size_t na, const uint32_t *b, size_t nb,
+                   uint32_t *r, uint64_t base) {
+  size_t n = na + nb - 1, len = 1;
+  while (len < n)
+    len <<= 1;
+  uint32_t *fa = CheckedAlloc(len * sizeof(uint32_t));
+  uint32_t *fb = CheckedAlloc(len * sizeof(uint32_t));
+  uint32_t *twiddles = CheckedAlloc(len / 2 * sizeof(uint32_t) + 4);
+  uint32_t *res = CheckedAlloc(3 * n * sizeof(uint32_t));
+
+  for (int prime = 0; prime < 3; prime++) {
+    uint32_t q = kNttPrimes[prime];
+    memset(fa, 0, len * sizeof(uint32_t));
+    memset(fb, 0, len * sizeof(uint32_t));
+    for (size_t i = 0; i < na; i++)
+      fa[i] = a[i] % q;
+    for (size_t i = 0; i < nb; i++)
+      fb[i] = b[i] % q;
+    Ntt(fa, len, false, twiddles, prime);
+    Ntt(fb, len, false, twiddles, prime);
+    for (size_t i = 0; i < len; i++)
+      fa[i] = (uint32_t)((uint64_t)fa[i] * fb[i] % q);
+    Ntt(fa, len, true, twiddles, prime);
+    memcpy(res + prime * n, fa, n * sizeof(uint32_t));
+  }
+
+  unsigned __int128 carry = 0;
+  for (size_t i = 0; i < n; i++) {
+    carry += NttCrt3(res[i], res[n + i], res[2 * n + i]);
+    r[i] = (uint32_t)(carry % base);
+    carry /= base;
+  }
+  r[n] = (uint32_t)carry;
+
+  free(res);
+  free(twiddles);
+  free(fb);
+  free(fa);
+}
+
+// r[0..na + nb) = a * b.
+static void MulRaw(const uint32_t *a, size_t na, const uint32_t *b, size_t nb,
+                   uint32_t *r, uint64_t base) {
+  if (na < nb) {
+    const uint32_t *t = a;
+    a = b;
+    b = t;
+    size_t tn = na;
+    na = nb;
+    nb = tn;
+  }
+  if (nb == 0) {
+    memset(r, 0, na * sizeof(uint32_t));
+    return;
+  }
+  if (nb < KARATSUBA_THRESHOLD) {
+    Schoolbook(a, na, b, nb, r, base);
+    return;
+  }
+  if (nb >= NTT_THRESHOLD && nb < (NTT_MAX_LEN >> 1) &&
+      na + nb <= NTT_MAX_LEN) {
+    NttMul(a, na, b, nb, r, base);
+    return;
+  }
+
+  size_t m = (na + 1) / 2;
+  if (nb <= m) {
+    // Unbalanced: multiply nb-sized slices of a and accumulate.
+    uint32_t *part = CheckedAlloc(2 * nb * sizeof(uint32_t));
+    memset(r, 0, (na + nb) * sizeof(uint32_t));
+    for (size_t off = 0; off < na; off += nb) {
+      size_t len = na - off < nb ? na - off : nb;
+      MulRaw(a + off, len, b, nb, part, base);
+      AddInto(r + off, na + nb - off, part, len + nb, base);
+    }
+    free(part);
+    return;
+  }
+
+  // Karatsuba: a = a1 B^m + a0, b = b1 B^m + b0.
+  size_t na1 = na - m, nb1 = nb - m;
+  uint32_t *sa = CheckedAlloc((m + 1) * sizeof(uint32_t));
+  uint32_t *sb = CheckedAlloc((m + 1) * sizeof(uint32_t));
+  uint32_t *mid = CheckedAlloc((2 * m + 2) * sizeof(uint32_t));
+
+  memcpy(sa, a, m * sizeof(uint32_t));
+  sa[m] = AddInto(sa, m, a + m, na1, base);
+  memcpy(sb, b, m * sizeof(uint32_t));
+  sb[m] = AddInto(sb, m, b + m, nb1, base);
+
+  MulRaw(a, m, b, m, r, base);                  // z0 -> r[0..2m)
+  MulRaw(a + m, na1, b + m, nb1, r + 2 * m, base); // z2 -> r[2m..)
+  MulRaw(sa, m + 1, sb, m + 1, mid, base);
+  SubFrom(mid, 2 * m + 2, r, 2 * m, base);
+  SubFrom(mid, 2 * m + 2, r + 2 * m, na1 + nb1, base);
+  AddInto(r + m, na + nb - m, mid, Trim(mid, 2 * m + 2), base);
+
+  free(mid);
+  free(sb);
+  free(sa);
+}
+
+void BigMul(struct BigNum *r, const struct BigNum *a, const struct BigNum *b,
+            uint64_t base) {
+  if (a->len == 0 || b->len == 0) {
+    r->len = 0;
+    return;
+  }
+  Reserve(r, a->len + b->len);
+  MulRaw(a->limb, a->len, b->limb, b->len, r->limb, base);
+  r->len = Trim(r->limb, a->len + b->len);
+}
+
+void BigAdd(struct BigNum *x, const struct BigNum *y, uint64_t base) {
+  size_t n = (x->len > y->len ? x->len : y->len) + 1;
+  Reserve(x, n);
+  memset(x->limb + x->len, 0, (n - x->len) * sizeof(uint32_t));
+  AddInto(x->limb, n, y->limb, y->len, base);
+  x->len = Trim(x->limb, n);
+}
+
+void BigShiftLeft(struct BigNum *x, uint64_t bits) {
+  if (x->len == 0 || bits == 0)
+    return;
+  size_t words = bits / 32;
+  unsigned shift = bits % 32;
+  Reserve(x, x->len + words + 1);
+  x->limb[x->len] = 0;
+  for (size_t i = x->len + 1; i-- > 0;) {
+    uint64_t hi = (uint64_t)x->limb[i] << shift;
+    uint64_t lo = (shift && i > 0) ? x->limb[i - 1] >> (32 - shift) : 0;
+    x->limb[i + words] = (uint32_t)(hi | lo);
+  }
+  memset(x->limb, 0, words * sizeof(uint32_t));
+  x->len = Trim(x->limb, x->len + words + 1);
+}
+
+size_t BigBitLength(const struct BigNum *x) {
+  if (x->len == 0)
+    return 0;
+  return (x->len - 1) * 32 + (32 - __builtin_clz(x->limb[x->len - 1]));
+}
+
+char *BigToHex(const struct BigNum *x) {
+  char *out = CheckedAlloc(x->len * 8 + 2);
+  if (x->len == 0) {
+    strcpy(out, "0");
+    return out;
+  }
+  size_t pos = sprintf(out, "%x", x->limb[x->len - 1]);
+  for (size_t i = x->len - 1; i-- > 0;)
+    pos += sprintf(out + pos, "%08x", x->limb[i]);
+  return out;
+}
+
+/* --- Binary to decimal ----------------------------------------------------- */
+
+// Divide and conquer: value(lo..hi) = value(lo..mid) + value(mid..hi) *
+// 2^(32 * (mid - lo)), with the powers precomputed in base 10^9 by squaring,
+// so the conversion costs a few big multiplications instead of O(n^2).
+static void ToDecimalRange(const uint32_t *limb, size_t n,
+                           const struct BigNum *powers, int level,
+                           struct BigNum *out) {
+  if (n <= DECIMAL_LEAF) {
+    out->len = 0;
+    for (size_t i = n; i-- > 0;) {
+      BigMulSmall(out, 1u << 16, 0, BIG_BASE_DEC);
+      BigMulSmall(out, 1u << 16, limb[i], BIG_BASE_DEC);
+    }
+    return;
+  }
+  while ((1ULL << level) >= n)
+    level--;
+  size_t half = (size_t)1 << level;
+
+  struct BigNum lo, hi, scaled;
+  BigInit(&lo);
+  BigInit(&hi);
+  BigInit(&scaled);
+  ToDecimalRange(limb, half, powers, level - 1, &lo);
+  ToDecimalRange(limb + half, n - half, powers, level, &hi);
+  BigMul(&scaled, &hi, &powers[level], BIG_BASE_DEC);
+  BigAdd(&scaled, &lo, BIG_BASE_DEC);
+  BigCopy(out, &scaled);
+  BigFree(&scaled);
+  BigFree(&hi);
+  BigFree(&lo);
+}
+
+char *BigToDecimal(const struct BigNum *x) {
+  int levels = 1;
+  while (((size_t)1 << levels) < x->len)
+    levels++;
+  // powers[j] = 2^(32 * 2^j) in base 10^9.
+  struct BigNum powers[levels + 1];
+  BigInit(&powers[0]);
+  BigSetU64(&powers[0], BIG_BASE_BIN, BIG_BASE_DEC);
+  for (int j = 1; j <= levels; j++) {
+    BigInit(&powers[j]);
+    if (((size_t)1 << j) < x->len)
+      BigMul(&powers[j], &powers[j - 1], &powers[j - 1], BIG_BASE_DEC);
+  }
+
+  struct BigNum dec;
+  BigInit(&dec);
+  ToDecimalRange(x->limb, x->len, powers, levels, &dec);
+  for (int j = 0; j <= levels; j++)
+    BigFree(&powers[j]);
+
+  char *out = CheckedAlloc(dec.len * 9 + 2);
+  if (dec.len == 0) {
+    strcpy(out, "0");
+  } else {
+    size_t pos = sprintf(out, "%u", dec.limb[dec.len - 1]);
+    for (size_t i = dec.len - 1; i-- > 0;)
+      pos += sprintf(out + pos, "%09u", dec.limb[i]);
+  }
+  BigFree(&dec);
+  return out;
+}
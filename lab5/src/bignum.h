@@ -0,0 +1,39 @@
+#ifndef BIGNUM_H
+#define BIGNUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Little-endian limbs; every arithmetic call takes the radix the limbs are
+// in: BIG_BASE_BIN for binary numbers, BIG_BASE_DEC for decimal output.
+#define BIG_BASE_BIN (1ULL << 32)
+#define BIG_BASE_DEC 1000000000ULL
+
+struct BigNum {
+  uint32_t *limb;
+  size_t len; // no leading zero limbs; 0 represents zero
+  size_t cap;
+};
+
+void BigInit(struct BigNum *x);
+void BigFree(struct BigNum *x);
+void BigSetU64(struct BigNum *x, uint64_t value, uint64_t base);
+void BigCopy(struct BigNum *dst, const struct BigNum *src);
+
+// x = x * m + add.
+void BigMulSmall(struct BigNum *x, uint32_t m, uint32_t add, uint64_t base);
+// x = x + y.
+void BigAdd(struct BigNum *x, const struct BigNum *y, uint64_t base);
+// r = a * b (r may alias neither). Schoolbook for short operands, Karatsuba
+// in the middle and a three-prime NTT for the large top-level products.
+void BigMul(struct BigNum *r, const struct BigNum *a, const struct BigNum *b,
+            uint64_t base);
+// x = x * 2^bits, binary only.
+void BigShiftLeft(struct BigNum *x, uint64_t bits);
+
+size_t BigBitLength(const struct BigNum *x);
+// Newly allocated strings; x is binary.
+char *BigToHex(const struct BigNum *x);
+char *BigToDecimal(const struct BigNum *x);
+
+#endif
@@ -0,0 +1,311 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "factmod.h"
+
+#define CHECKPOINT_MAGIC 0x31544b4354434146ULL // "FACTCKT1"
+#define CHECKPOINT_INITIAL_CAPACITY 1024
+#define CHECKPOINT_MAX_STORES 16
+
+static size_t FileSizeFor(uint64_t capacity) {
+  return sizeof(struct CheckpointHeader) +
+         (capacity + 1) * sizeof(struct CheckpointEntry);
+}
+
+// Maps the whole file again if another process (or an append) grew it.
+static bool SyncMapping(struct CheckpointStore *store) {
+  if (store->header != NULL &&
+      FileSizeFor(store->header->capacity) <= store->mapped_size)
+    return true;
+
+  struct stat st;
+  if (fstat(store->fd, &st) < 0)
+    return false;
+  if (store->header != NULL)
+    munmap(store->header, store->mapped_size);
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, store->fd, 0);
+  if (map == MAP_FAILED) {
+    store->header = NULL;
+    return false;
+  }
+  store->header = map;
+  store->entries = (struct CheckpointEntry *)((char *)map + sizeof(*store->header));
+  store->mapped_size = (size_t)st.st_size;
+  return true;
+}
+
+bool CheckpointOpen(struct CheckpointStore *store, const char *dir,
+                    uint64_t mod, uint64_t stride) {
+  memset(store, 0, sizeof(*store));
+  store->fd = -1;
+  if (mod == 0 || stride == 0)
+    return false;
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    perror("mkdir");
+    return false;
+  }
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/fact_%llu.ckpt", dir,
+           (unsigned long long)mod);
+  store->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (store->fd < 0) {
+    perror("open");
+    return false;
+  }
+
+  flock(store->fd, LOCK_EX);
+  struct stat st;
+  bool ok = fstat(store->fd, &st) == 0;
+  if (ok && (size_t)st.st_size < sizeof(struct CheckpointHeader)) {
+    struct CheckpointHeader header = {CHECKPOINT_MAGIC, mod, stride, 0,
+                                      CHECKPOINT_INITIAL_CAPACITY};
+    struct CheckpointEntry zero = {1 % mod, 1 % mod};
+    ok = ftruncate(store->fd, FileSizeFor(header.capacity)) == 0 &&
+         pwrite(store->fd, &header, sizeof(header), 0) == sizeof(header) &&
+         pwrite(store->fd, &zero, sizeof(zero), sizeof(header)) == sizeof(zero);
+  }
+  ok = ok && SyncMapping(store);
+  flock(store->fd, LOCK_UN);
+
+  if (!ok || store->header->magic != CHECKPOINT_MAGIC ||
+      store->header->mod != mod) {
+    fprintf(stderr, "Checkpoint file %s is unusable\n", path);
+    CheckpointClose(store);
+    return false;
+  }
+  store->mod = mod;
+  store->stride = store->header->stride;
+  pthread_mutex_init(&store->lock, NULL);
+  return true;
+}
+
+void CheckpointClose(struct CheckpointStore *store) {
+  if (store->header != NULL)
+    munmap(store->header, store->mapped_size);
+  if (store->fd >= 0)
+    close(store->fd);
+  store->header = NULL;
+  store->fd = -1;
+}
+
+struct CheckpointStore *CheckpointStoreFor(const char *dir, uint64_t mod) {
+  static struct CheckpointStore stores[CHECKPOINT_MAX_STORES];
+  static int nstores = 0;
+  static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  struct CheckpointStore *found = NULL;
+  pthread_mutex_lock(&table_lock);
+  for (int i = 0; i < nstores && found == NULL; i++) {
+    if (stores[i].mod == mod)
+      found = &stores[i];
+  }
+  if (found == NULL && nstores < CHECKPOINT_MAX_STORES &&
+      CheckpointOpen(&stores[nstores], dir, mod, CHECKPOINT_DEFAULT_STRIDE))
+    found = &stores[nstores++];
+  pthread_mutex_unlock(&table_lock);
+  return found;
+}
+
+// Appends entry i when it directly extends the recorded prefix. Caller holds
+// store->lock.
+static void Append(struct CheckpointStore *store, uint64_t i, uint64_t block) {
+  flock(store->fd, LOCK_EX);
+  if (!SyncMapping(store) || store->header->count + 1 != i) {
+    flock(store->fd, LOCK_UN);
+    return;
+  }
+  if (i > store->header->capacity) {
+    uint64_t capacity = store->header->capacity * 2;
+    if (ftruncate(store->fd, FileSizeFor(capacity)) < 0) {
+      flock(store->fd, LOCK_UN);
+      return;
+    }
+    store->header->capacity = capacity;
+    if (!SyncMapping(store)) {
+      flock(store->fd, LOCK_UN);
+      return;
+    }
+  }
+  struct CheckpointEntry *entry = &store->entries[i];
+  entry->block = block;
+  entry->prefix = MulMod(store->entries[i - 1].prefix, block, store->mod);
+  __atomic_store_n(&store->header->count, i, __ATOMIC_RELEASE);
+  flock(store->fd, LOCK_UN);
+}
+
+struct BlockRun {
+  uint64_t mod;
+  uint64_t stride;
+  uint64_t first; // block index
+  uint64_t n;
+  uint64_t *products;
+};
+
+static void *ComputeBlockRun(void *arg) {
+  struct BlockRun *run = arg;
+  for (uint64_t t = 0; t < run->n; t++) {
+    uint64_t block = run->first + t;
+    run->products[t] = RangeProductMod((block - 1) * run->stride + 1,
+                                       block * run->stride, run->mod);
+  }
+  return NULL;
+}
+
+// Who multiplies what the file does not have: the caller's product
+// function if it has one, otherwise pnum threads of our own.
+struct Multiplier {
+  int pnum;
+  CheckpointProductFn product;
+  void *ctx;
+};
+
+static uint64_t MultiplyRange(const struct Multiplier *m, uint64_t begin,
+                              uint64_t end, uint64_t mod) {
+  return m->product != NULL ? m->product(m->ctx, begin, end, mod)
+                            : RangeProductMod(begin, end, mod);
+}
+
+// Products of blocks first..first + n - 1.
+static void ComputeBlocks(const struct CheckpointStore *store, uint64_t first,
+                          uint64_t n, const struct Multiplier *m,
+                          uint64_t *products) {
+  int pnum = m->pnum;
+  if (m->product != NULL || pnum <= 1) {
+    for (uint64_t t = 0; t < n; t++)
+      products[t] = MultiplyRange(m, (first + t - 1) * store->stride + 1,
+                                  (first + t) * store->stride, store->mod);
+    return;
+  }
+  if ((uint64_t)pnum > n)
+    pnum = (int)n;
+  pthread_t threads[pnum];
+  struct BlockRun runs[pnum];
+  uint64_t next = 0;
+  for (int i = 0; i < pnum; i++) {
+    uint64_t len = n / pnum + ((uint64_t)i < n % pnum ? 1 : 0);
+    runs[i] = (struct BlockRun){store->mod, store->stride, first + next, len,
+                                products + next};
+    next += len;
+    if (pthread_create(&threads[i], NULL, ComputeBlockRun, &runs[i]) != 0) {
+      ComputeBlockRun(&runs[i]);
+      threads[i] = 0;
+    }
+  }
+  for (int i = 0; i < pnum; i++) {
+    if (threads[i] != 0)
+      pthread_join(threads[i], NULL);
+  }
+}
+
+static uint64_t RangeProduct(struct CheckpointStore *store, uint64_t begin,
+                             uint64_t end, const struct Multiplier *m) {
+  uint64_t mod = store->mod, stride = store->stride;
+  if (begin == 0)
+    begin = 1;
+  if (begin > end)
+    return 1 % mod;
+
+  uint64_t acc = 1 % mod, cur = begin;
+  pthread_mutex_lock(&store->lock);
+  store->stats.terms += end - begin + 1;
+  if (!SyncMapping(store)) {
+    pthread_mutex_unlock(&store->lock);
+    return MultiplyRange(m, begin, end, mod);
+  }
+  uint64_t count = __atomic_load_n(&store->header->count, __ATOMIC_ACQUIRE);
+  if (begin == 1) {
+    uint64_t j = end / stride < count ? end / stride : count;
+    if (j > 0) {
+      acc = store->entries[j].prefix;
+      cur = j * stride + 1;
+      store->stats.hits++;
+    }
+  }
+
+  // The lock guards the table only; nothing is multiplied while holding it.
+  while (cur <= end && acc != 0) {
+    uint64_t block = (cur - 1) / stride + 1;
+    uint64_t block_end = block * stride;
+    bool aligned = cur == (block - 1) * stride + 1 && block_end <= end;
+    uint64_t n = aligned ? end / stride - block + 1 : 0;
+    uint64_t *products = NULL;
+
+    if (aligned && block <= count) {
+      acc = MulMod(acc, store->entries[block].block, mod);
+      store->stats.hits++;
+      cur = block_end + 1;
+    } else if (aligned && (products = malloc(n * sizeof(uint64_t))) != NULL) {
+      pthread_mutex_unlock(&store->lock);
+      ComputeBlocks(store, block, n, m, products);
+      pthread_mutex_lock(&store->lock);
+      for (uint64_t t = 0; t < n; t++) {
+        acc = MulMod(acc, products[t], mod);
+        Append(store, block + t, products[t]);
+      }
+      free(products);
+      store->stats.misses += n;
+      store->stats.terms_computed += n * stride;
+      cur = (block + n - 1) * stride + 1;
+    } else {
+      // An unaligned head or tail, or, with no room to record blocks, the
+      // whole rest of the range.
+      uint64_t stop = !aligned && block_end < end ? block_end : end;
+      pthread_mutex_unlock(&store->lock);
+      uint64_t part = MultiplyRange(m, cur, stop, mod);
+      pthread_mutex_lock(&store->lock);
+      acc = MulMod(acc, part, mod);
+      store->stats.terms_computed += stop - cur + 1;
+      cur = stop + 1;
+    }
+    if (!SyncMapping(store)) {
+      pthread_mutex_unlock(&store->lock);
+      return cur <= end ? MulMod(acc, MultiplyRange(m, cur, end, mod), mod)
+                        : acc;
+    }
+    count = __atomic_load_n(&store->header->count, __ATOMIC_ACQUIRE);
+  }
+  pthread_mutex_unlock(&store->lock);
+  return acc;
+}
+
+uint64_t CheckpointRangeProduct(struct CheckpointStore *store, uint64_t begin,
+                                uint64_t end, int pnum) {
+  struct Multiplier m = {pnum, NULL, NULL};
+  return RangeProduct(store, begin, end, &m);
+}
+
+uint64_t CheckpointRangeProductWith(struct CheckpointStore *store,
+                                    uint64_t begin, uint64_t end,
+                                    CheckpointProductFn product, void *ctx) {
+  struct Multiplier m = {1, product, ctx};
+  return RangeProduct(store, begin, end, &m);
+}
+
+void CheckpointPrintStats(const struct CheckpointStore *store) {
+  const struct CheckpointStats *st = &store->stats;
+  char speedup[32];
+  if (st->terms_computed > 0)
+    snprintf(speedup, sizeof(speedup), "speedup x%.1f",
+             (double)st->terms / st->terms_computed);
+  else
+    snprintf(speedup, sizeof(speedup), "all from checkpoints");
+  printf("Checkpoints mod %llu: %llu recorded, hits %llu, misses %llu, "
+         "computed %llu of %llu terms (%s)\n",
+         (unsigned long long)store->mod,
+         (unsigned long long)store->header->count,
+         (unsigned long long)st->hits, (unsigned long long)st->misses,
+         (unsigned long long)st->terms_computed,
+         (unsigned long long)st->terms, speedup);
+}
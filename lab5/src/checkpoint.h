@@ -0,0 +1,71 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CHECKPOINT_DEFAULT_STRIDE (1ULL << 20)
+
+struct CheckpointEntry {
+  uint64_t prefix; // (i * stride)! mod m
+  uint64_t block;  // ((i - 1) * stride + 1) * ... * (i * stride) mod m
+};
+
+struct CheckpointHeader {
+  uint64_t magic;
+  uint64_t mod;
+  uint64_t stride;
+  uint64_t count;    // entries 1..count are valid
+  uint64_t capacity; // entries the file has room for
+};
+
+struct CheckpointStats {
+  uint64_t hits;          // checkpoint entries reused
+  uint64_t misses;        // stride blocks computed from scratch
+  uint64_t terms;         // multiplications a cold query would need
+  uint64_t terms_computed;
+};
+
+// One memory-mapped file of checkpoints per modulus, <dir>/fact_<mod>.ckpt.
+// Entries are append-only and only ever extend the contiguous prefix, so
+// readers never see a hole; appends take an flock on the file.
+struct CheckpointStore {
+  int fd;
+  uint64_t mod;
+  uint64_t stride;
+  size_t mapped_size;
+  struct CheckpointHeader *header;
+  struct CheckpointEntry *entries;
+  pthread_mutex_t lock;
+  struct CheckpointStats stats;
+};
+
+bool CheckpointOpen(struct CheckpointStore *store, const char *dir,
+                    uint64_t mod, uint64_t stride);
+void CheckpointClose(struct CheckpointStore *store);
+
+// Returns a store for mod from a small process-wide table, opening it on
+// first use. NULL when the file can not be created.
+struct CheckpointStore *CheckpointStoreFor(const char *dir, uint64_t mod);
+
+// Product of begin..end mod store->mod. Whole stride blocks come from the
+// file when recorded; fresh blocks are computed by up to pnum threads and
+// appended when they extend the recorded prefix.
+uint64_t CheckpointRangeProduct(struct CheckpointStore *store, uint64_t begin,
+                                uint64_t end, int pnum);
+
+// begin * ... * end mod mod, computed however the caller likes.
+typedef uint64_t (*CheckpointProductFn)(void *ctx, uint64_t begin,
+                                        uint64_t end, uint64_t mod);
+
+// Like CheckpointRangeProduct, but whatever the file lacks is computed by
+// product, one call per block or partial block, so a caller with its own
+// worker pool starts no threads here.
+uint64_t CheckpointRangeProductWith(struct CheckpointStore *store,
+                                    uint64_t begin, uint64_t end,
+                                    CheckpointProductFn product, void *ctx);
+
+void CheckpointPrintStats(const struct CheckpointStore *store);
+
+#endif
@@ -0,0 +1,447 @@
+#include "factmod.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntt.h"
+
+// Largest block used by the block-shift engine; bounds memory to a few
+// tens of megabytes and keeps convolutions exact with three NTT primes.
+#define FACT_MAX_BLOCK (1ULL << 20)
+#define LOW31_MASK ((1ULL << 31) - 1)
+
+uint64_t MulMod(uint64_t a, uint64_t b, uint64_t mod) {
+  return (uint64_t)((unsigned __int128)a * b % mod);
+}
+
+uint64_t PowMod(uint64_t a, uint64_t e, uint64_t mod) {
+  uint64_t result = 1 % mod;
+  a %= mod;
+  while (e > 0) {
+    if (e & 1)
+      result = MulMod(result, a, mod);
+    a = MulMod(a, a, mod);
+    e >>= 1;
+  }
+  return result;
+}
+
+uint64_t InvMod(uint64_t a, uint64_t mod) {
+  __int128 old_r = a % mod, r = mod;
+  __int128 old_s = 1, s = 0;
+  while (r != 0) {
+    __int128 q = old_r / r, tmp;
+    tmp = old_r - q * r;
+    old_r = r;
+    r = tmp;
+    tmp = old_s - q * s;
+    old_s = s;
+    s = tmp;
+  }
+  if (old_r != 1)
+    return 0;
+  if (old_s < 0)
+    old_s += mod;
+  return (uint64_t)old_s;
+}
+
+bool IsPrime64(uint64_t n) {
+  if (n < 2)
+    return false;
+  static const uint64_t kBases[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+  for (size_t i = 0; i < sizeof(kBases) / sizeof(kBases[0]); i++) {
+    if (n % kBases[i] == 0)
+      return n == kBases[i];
+  }
+
+  uint64_t d = n - 1;
+  int s = 0;
+  while ((d & 1) == 0) {
+    d >>= 1;
+    s++;
+  }
+  for (size_t i = 0; i < sizeof(kBases) / sizeof(kBases[0]); i++) {
+    uint64_t x = PowMod(kBases[i], d, n);
+    if (x == 1 || x == n - 1)
+      continue;
+    bool composite = true;
+    for (int r = 1; r < s; r++) {
+      x = MulMod(x, x, n);
+      if (x == n - 1) {
+        composite = false;
+        break;
+      }
+    }
+    if (composite)
+      return false;
+  }
+  return true;
+}
+
+uint64_t RangeProductMod(uint64_t begin, uint64_t end, uint64_t mod) {
+  if (begin == 0)
+    begin = 1;
+  uint64_t result = 1 % mod;
+  for (uint64_t i = begin; i <= end && result != 0; i++) {
+    result = MulMod(result, i, mod);
+    if (i == UINT64_MAX)
+      break;
+  }
+  return result;
+}
+
+/* --- Exact convolution modulo an arbitrary p < 2^62 ---------------------- */
+
+// Operands are split into 31-bit halves; every partial convolution is then
+// below 2^84 for blocks of 2^20 and is recovered exactly by NttCrt3.
+
+// Forward transforms of one operand, kept for reuse across several
+// convolutions against it.
+struct NttOperand {
+  size_t len;
+  uint32_t *hat; // [prime][half][len]
+};
+
+static void NttOperandInit(struct NttOperand *op, const uint64_t *x, size_t n,
+                           size_t len, uint32_t *twiddles) {
+  op->len = len;
+  op->hat = calloc(6 * len, sizeof(uint32_t));
+  if (op->hat == NULL) {
+    fprintf(stderr, "factmod: out of memory\n");
+    exit(1);
+  }
+  for (int prime = 0; prime < 3; prime++) {
+    uint32_t q = kNttPrimes[prime];
+    uint32_t *lo = op->hat + (2 * prime) * len;
+    uint32_t *hi = op->hat + (2 * prime + 1) * len;
+    for (size_t i = 0; i < n; i++) {
+      lo[i] = (uint32_t)((x[i] & LOW31_MASK) % q);
+      hi[i] = (uint32_t)((x[i] >> 31) % q);
+    }
+    Ntt(lo, len, false, twiddles, prime);
+    Ntt(hi, len, false, twiddles, prime);
+  }
+}
+
+static void NttOperandFree(struct NttOperand *op) { free(op->hat); }
+
+// out[t] = sum_i a[i] * b[lo + t - i] mod p for t in [0, cnt), where the
+// cyclic length of `a` was chosen so that wrap-around misses [lo, lo + cnt).
+static void MiddleProduct(const struct NttOperand *a, const uint64_t *b,
+                          size_t nb, size_t lo, size_t cnt, uint64_t p,
+                          uint32_t *twiddles, uint64_t *out) {
+  size_t len = a->len;
+  uint32_t *buf = malloc(3 * len * sizeof(uint32_t));
+  uint32_t *res = malloc(9 * cnt * sizeof(uint32_t));
+  if (buf == NULL || res == NULL) {
+    fprintf(stderr, "factmod: out of memory\n");
+    exit(1);
+  }
+
+  for (int prime = 0; prime < 3; prime++) {
+    const uint64_t q = kNttPrimes[prime];
+    const uint32_t *a0 = a->hat + (2 * prime) * len;
+    const uint32_t *a1 = a->hat + (2 * prime + 1) * len;
+    uint32_t *c0 = buf, *c1 = buf + len, *c2 = buf + 2 * len;
+
+    memset(c0, 0, 2 * len * sizeof(uint32_t));
+    for (size_t i = 0; i < nb; i++) {
+      c0[i] = (uint32_t)((b[i] & LOW31_MASK) % q);
+      c1[i] = (uint32_t)((b[i] >> 31) % q);
+    }
+    Ntt(c0, len, false, twiddles, prime);
+    Ntt(c1, len, false, twiddles, prime);
+    for (size_t i = 0; i < len; i++) {
+      uint64_t x0 = a0[i], x1 = a1[i], y0 = c0[i], y1 = c1[i];
+      c0[i] = (uint32_t)(x0 * y0 % q);
+      c2[i] = (uint32_t)(x1 * y1 % q);
+      c1[i] = (uint32_t)((x0 * y1 + x1 * y0) % q);
+    }
+    for (int part = 0; part < 3; part++) {
+      uint32_t *c = buf + part * len;
+      Ntt(c, len, true, twiddles, prime);
+      memcpy(res + (3 * prime + part) * cnt, c + lo, cnt * sizeof(uint32_t));
+    }
+  }
+
+  uint64_t shift31 = (1ULL << 31) % p;
+  uint64_t shift62 = MulMod(shift31, shift31, p);
+  for (size_t t = 0; t < cnt; t++) {
+    uint64_t part[3];
+    for (int k = 0; k < 3; k++) {
+      part[k] = (uint64_t)(NttCrt3(res[k * cnt + t], res[(3 + k) * cnt + t],
+                                res[(6 + k) * cnt + t]) %
+                           p);
+    }
+    out[t] = (part[0] + MulMod(part[1], shift31, p) +
+              MulMod(part[2], shift62, p)) %
+             p;
+  }
+
+  free(res);
+  free(buf);
+}
+
+/* --- sqrt(n) block-shift factorial ---------------------------------------- */
+
+// Batch-inverts vals[0..n) into inv (Montgomery's trick, one InvMod).
+static void BatchInverse(const uint64_t *vals, size_t n, uint64_t p,
+                         uint64_t *inv) {
+  uint64_t acc = 1;
+  for (size_t i = 0; i < n; i++) {
+    inv[i] = acc;
+    acc = MulMod(acc, vals[i], p);
+  }
+  acc = InvMod(acc, p);
+  for (size_t i = n; i-- > 0;) {
+    inv[i] = MulMod(inv[i], acc, p);
+    acc = MulMod(acc, vals[i], p);
+  }
+}
+
+struct ShiftContext {
+  uint64_t p;
+  const uint64_t *inv_fact;
+  uint32_t *twiddles;
+};
+
+// Given h(0..d) of a polynomial of degree d, writes h(m_j .. m_j + d) into
+// outs[j] for every requested shift. Each m_j must keep m_j - d .. m_j + d
+// away from 0 modulo p.
+static void ShiftSamples(const struct ShiftContext *ctx, const uint64_t *h,
+                         size_t d, const uint64_t *shifts, size_t nshifts,
+                         uint64_t **outs) {
+  uint64_t p = ctx->p;
+  size_t nb = 2 * d + 1;
+  uint64_t *a = malloc((d + 1) * sizeof(uint64_t));
+  uint64_t *vals = malloc(nb * sizeof(uint64_t));
+  uint64_t *inv = malloc(nb * sizeof(uint64_t));
+  uint64_t *conv = malloc((d + 1) * sizeof(uint64_t));
+  if (a == NULL || vals == NULL || inv == NULL || conv == NULL) {
+    fprintf(stderr, "factmod: out of memory\n");
+    exit(1);
+  }
+
+  // Lagrange weights h(i) / (i! (d - i)! (-1)^(d - i)).
+  for (size_t i = 0; i <= d; i++) {
+    a[i] = MulMod(MulMod(h[i], ctx->inv_fact[i], p), ctx->inv_fact[d - i], p);
+    if ((d - i) & 1)
+      a[i] = (p - a[i]) % p;
+  }
+
+  size_t len = 1;
+  while (len < nb)
+    len <<= 1;
+  struct NttOperand a_hat;
+  NttOperandInit(&a_hat, a, d + 1, len, ctx->twiddles);
+
+  for (size_t s = 0; s < nshifts; s++) {
+    uint64_t m = shifts[s];
+    for (size_t j = 0; j < nb; j++)
+      vals[j] = (m + j + p - d) % p;
+    BatchInverse(vals, nb, p, inv);
+    MiddleProduct(&a_hat, inv, nb, d, d + 1, p, ctx->twiddles, conv);
+
+    // h(m + k) = conv[k] * prod_{t=k}^{k+d} vals[t].
+    uint64_t window = 1;
+    for (size_t t = 0; t <= d; t++)
+      window = MulMod(window, vals[t], p);
+    for (size_t k = 0; k <= d; k++) {
+      outs[s][k] = MulMod(conv[k], window, p);
+      if (k < d)
+        window = MulMod(MulMod(window, vals[k + d + 1], p), inv[k], p);
+    }
+  }
+
+  NttOperandFree(&a_hat);
+  free(conv);
+  free(inv);
+  free(vals);
+  free(a);
+}
+
+static uint64_t Isqrt64(uint64_t n) {
+  uint64_t r = 0;
+  for (int bit = 31; bit >= 0; bit--) {
+    uint64_t cand = r | (1ULL << bit);
+    if (cand * cand <= n)
+      r = cand;
+  }
+  return r;
+}
+
+// n! mod p for 2 <= n <= (p - 1) / 2 and p < 2^62. With v = sqrt(n) and
+// g_d(x) = (vx + 1)(vx + 2)...(vx + d), n! is the product of g_v(0..n/v - 1)
+// and a short tail. The samples g_d(0..d) are grown d -> 2d -> 2d + 1 along
+// the bits of v, each doubling costing three Lagrange shifts.
+static uint64_t BlockShiftFactorial(uint64_t n, uint64_t p) {
+  uint64_t v = Isqrt64(n);
+  if (v > FACT_MAX_BLOCK)
+    v = FACT_MAX_BLOCK;
+  uint64_t blocks = n / v;
+
+  uint64_t *fact = malloc((v + 1) * sizeof(uint64_t));
+  uint64_t *inv_fact = malloc((v + 1) * sizeof(uint64_t));
+  uint64_t *g = malloc((v + 2) * sizeof(uint64_t));
+  uint64_t *scratch = malloc(3 * (v + 1) * sizeof(uint64_t));
+  uint32_t *twiddles = malloc((4 * v + 4) * sizeof(uint32_t));
+  if (fact == NULL || inv_fact == NULL || g == NULL || scratch == NULL ||
+      twiddles == NULL) {
+    fprintf(stderr, "factmod: out of memory\n");
+    exit(1);
+  }
+
+  fact[0] = 1;
+  for (uint64_t i = 1; i <= v; i++)
+    fact[i] = MulMod(fact[i - 1], i, p);
+  inv_fact[v] = InvMod(fact[v], p);
+  for (uint64_t i = v; i > 0; i--)
+    inv_fact[i - 1] = MulMod(inv_fact[i], i, p);
+
+  struct ShiftContext ctx = {p, inv_fact, twiddles};
+  uint64_t *outs[3] = {scratch, scratch + (v + 1), scratch + 2 * (v + 1)};
+  uint64_t inv_v = InvMod(v, p);
+
+  uint64_t d = 1;
+  g[0] = 1;
+  g[1] = (v + 1) % p;
+  int top = 63 - __builtin_clzll(v);
+  for (int bit = top - 1; bit >= 0; bit--) {
+    // g_2d(x) = g_d(x) * g_d(x + d / v), sampled at 0..2d + 1.
+    uint64_t d_over_v = MulMod(d, inv_v, p);
+    uint64_t shifts[3] = {d + 1, d_over_v, (d_over_v + d + 1) % p};
+    ShiftSamples(&ctx, g, d, shifts, 3, outs);
+    for (uint64_t i = 0; i <= d; i++) {
+      g[i] = MulMod(g[i], outs[1][i], p);
+      g[d + 1 + i] = MulMod(outs[0][i], outs[2][i], p);
+    }
+    d *= 2;
+
+    if ((v >> bit) & 1) {
+      for (uint64_t i = 0; i <= d; i++)
+        g[i] = MulMod(g[i], (v * i + d + 1) % p, p);
+      g[d + 1] = RangeProductMod(v * (d + 1) + 1, v * (d + 1) + d + 1, p);
+      d++;
+    }
+  }
+
+  uint64_t result = 1;
+  for (uint64_t i = 0; i < blocks && i <= v; i++)
+    result = MulMod(result, g[i], p);
+  // n / v exceeds v + 1 only when the block size was capped.
+  for (uint64_t start = v + 1; start < blocks; start += v + 1) {
+    ShiftSamples(&ctx, g, v, &start, 1, outs);
+    for (uint64_t i = 0; i <= v && start + i < blocks; i++)
+      result = MulMod(result, outs[0][i], p);
+  }
+  result = MulMod(result, RangeProductMod(blocks * v + 1, n, p), p);
+
+  free(twiddles);
+  free(scratch);
+  free(g);
+  free(inv_fact);
+  free(fact);
+  return result;
+}
+
+uint64_t FactorialModPrime(uint64_t k, uint64_t p) {
+  if (k >= p)
+    return 0;
+
+  // Wilson: k! * (k + 1)...(p - 1) = -1 and (k + 1)...(p - 1) = (-1)^n n!
+  // with n = p - 1 - k, so only the shorter side is ever evaluated.
+  uint64_t n = k;
+  bool reflected = false;
+  if (n > (p - 1) / 2) {
+    n = p - 1 - n;
+    reflected = true;
+  }
+
+  uint64_t r;
+  if (n < FACT_FAST_CROSSOVER || p >= (1ULL << 62))
+    r = RangeProductMod(2, n, p);
+  else
+    r = BlockShiftFactorial(n, p);
+
+  if (!reflected)
+    return r;
+  uint64_t inv = InvMod(r, p);
+  return (n % 2 == 0) ? (p - inv) % p : inv;
+}
+
+uint64_t RangeProductModPrime(uint64_t begin, uint64_t end, uint64_t p) {
+  if (begin == 0)
+    begin = 1;
+  if (begin > end)
+    return 1 % p;
+  // A multiple of p inside the range zeroes it; otherwise the residues of
+  // begin..end form the contiguous run (begin % p)..(end % p).
+  if (begin / p != end / p || end % p == 0)
+    return 0;
+  uint64_t hi = FactorialModPrime(end % p, p);
+  uint64_t lo = FactorialModPrime(begin % p - 1, p);
+  return MulMod(hi, InvMod(lo, p), p);
+}
+
+uint64_t FactorialModPrimeCost(uint64_t k, uint64_t p) {
+  if (k >= p)
+    return 1;
+  uint64_t n = k > (p - 1) / 2 ? p - 1 - k : k;
+  if (n < FACT_FAST_CROSSOVER || p >= (1ULL << 62))
+    return n;
+  return Isqrt64(n) * Isqrt64(FACT_FAST_CROSSOVER);
+}
+
+uint64_t RangeProductModPrimeCost(uint64_t begin, uint64_t end, uint64_t p) {
+  if (begin == 0)
+    begin = 1;
+  if (begin > end || begin / p != end / p || end % p == 0)
+    return 1;
+  return FactorialModPrimeCost(end % p, p) +
+         FactorialModPrimeCost(begin % p - 1, p);
+}
+
+bool ParseFactAlgo(const char *str, enum FactAlgo *algo) {
+  if (strcmp(str, "auto") == 0)
+    *algo = FACT_ALGO_AUTO;
+  else if (strcmp(str, "linear") == 0)
+    *algo = FACT_ALGO_LINEAR;
+  else if (strcmp(str, "fast") == 0)
+    *algo = FACT_ALGO_FAST;
+  else
+    return false;
+  return true;
+}
+
+const char *FactAlgoName(enum FactAlgo algo) {
+  switch (algo) {
+  case FACT_ALGO_LINEAR:
+    return "linear";
+  case FACT_ALGO_FAST:
+    return "fast";
+  default:
+    return "auto";
+  }
+}
+
+bool FactUseFast(uint64_t k, uint64_t mod, enum FactAlgo algo) {
+  if (algo == FACT_ALGO_LINEAR || mod < 2)
+    return false;
+  if (!IsPrime64(mod))
+    return false;
+  if (algo == FACT_ALGO_FAST)
+    return true;
+  // k >= p and the Wilson side are O(1)/short regardless of k.
+  if (k >= mod || mod - 1 - k < FACT_FAST_CROSSOVER)
+    return true;
+  return k >= FACT_FAST_CROSSOVER;
+}
+
+bool FactUseFastRange(uint64_t begin, uint64_t end, uint64_t mod,
+                      enum FactAlgo algo) {
+  if (algo == FACT_ALGO_LINEAR || mod < 2 || begin > end || !IsPrime64(mod))
+    return false;
+  return algo == FACT_ALGO_FAST ||
+         RangeProductModPrimeCost(begin, end, mod) < end - begin + 1;
+}
@@ -0,0 +1,43 @@
+#ifndef FACTMOD_H
+#define FACTMOD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Below this k the O(k) loop beats the sub-linear engine (see --bench).
+#define FACT_FAST_CROSSOVER (1ULL << 19)
+
+enum FactAlgo { FACT_ALGO_AUTO, FACT_ALGO_LINEAR, FACT_ALGO_FAST };
+
+uint64_t MulMod(uint64_t a, uint64_t b, uint64_t mod);
+uint64_t PowMod(uint64_t a, uint64_t e, uint64_t mod);
+// Returns 0 when a is not invertible modulo mod.
+uint64_t InvMod(uint64_t a, uint64_t mod);
+bool IsPrime64(uint64_t n);
+
+// Product of begin..end (inclusive) modulo mod, one multiplication per term.
+uint64_t RangeProductMod(uint64_t begin, uint64_t end, uint64_t mod);
+
+// k! mod p for prime p in O(sqrt(k) log k): returns 0 for k >= p, reflects
+// k > (p - 1) / 2 through Wilson's theorem and evaluates the rest with the
+// sqrt(k) block-shift technique.
+uint64_t FactorialModPrime(uint64_t k, uint64_t p);
+// Product of begin..end modulo prime p as a quotient of two factorials.
+uint64_t RangeProductModPrime(uint64_t begin, uint64_t end, uint64_t p);
+
+// Estimated cost of the two calls above, in the loop's multiplications:
+// the engine's O(sqrt(n)) is scaled to match the loop at the crossover.
+uint64_t FactorialModPrimeCost(uint64_t k, uint64_t p);
+uint64_t RangeProductModPrimeCost(uint64_t begin, uint64_t end, uint64_t p);
+
+bool ParseFactAlgo(const char *str, enum FactAlgo *algo);
+const char *FactAlgoName(enum FactAlgo algo);
+// Decides whether k! mod mod should go through FactorialModPrime.
+bool FactUseFast(uint64_t k, uint64_t mod, enum FactAlgo algo);
+// Same for begin * ... * end. The two factorials it is built from depend on
+// where the range sits, not on its length, so auto compares their cost
+// with the length.
+bool FactUseFastRange(uint64_t begin, uint64_t end, uint64_t mod,
+                      enum FactAlgo algo);
+
+#endif
@@ -4,6 +4,13 @@
 #include <string.h>
 #include <getopt.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "batch.h"
+#include "bigfact.h"
+#include "checkpoint.h"
+#include "factmod.h"
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 uint64_t partial_result = 1;
@@ -11,26 +18,22 @@ uint64_t mod = 0;
 
 typedef struct {
     int thread_id;
-    int k;
+    uint64_t k;
     int pnum;
-    int start;
-    int end;
+    uint64_t start;
+    uint64_t end;
 } thread_data_t;
 
 void* compute_partial_factorial(void* arg) {
     thread_data_t* data = (thread_data_t*)arg;
-    uint64_t local_result = 1;
     
-    printf("Thread %d: computing range %d to %d\n", 
-           data->thread_id, data->start, data->end);
+    printf("Thread %d: computing range %llu to %llu\n", data->thread_id,
+           (unsigned long long)data->start, (unsigned long long)data->end);
     
-    for (int i = data->start; i <= data->end; i++) {
-        if (i == 0) continue;
-        local_result = (local_result * i) % mod;
-    }
+    uint64_t local_result = RangeProductMod(data->start, data->end, mod);
     
     pthread_mutex_lock(&mutex);
-    partial_result = (partial_result * local_result) % mod;
+    partial_result = MulMod(partial_result, local_result, mod);
     printf("Thread %d: partial result = %llu (local), total = %llu\n", 
            data->thread_id, (unsigned long long)local_result, 
            (unsigned long long)partial_result);
@@ -39,15 +42,18 @@ void* compute_partial_factorial(void* arg) {
     return NULL;
 }
 
-uint64_t factorial_multithreaded(int k, int pnum) {
+uint64_t factorial_multithreaded(uint64_t k, int pnum) {
     if (k <= 1) return 1 % mod;
+    // mod divides k! as soon as k >= mod.
+    if (k >= mod) return 0;
+    if ((uint64_t)pnum > k) pnum = (int)k;
     
     pthread_t threads[pnum];
     thread_data_t thread_data[pnum];
     
-    int numbers_per_thread = k / pnum;
-    int remainder = k % pnum;
-    int current_start = 1;
+    uint64_t numbers_per_thread = k / pnum;
+    uint64_t remainder = k % pnum;
+    uint64_t current_start = 1;
     
     for (int i = 0; i < pnum; i++) {
         thread_data[i].thread_id = i;
@@ -64,8 +70,9 @@ uint64_t factorial_multithreaded(int k, int pnum) {
             thread_data[i].end = k;
         }
         
-        printf("Creating thread %d for range %d-%d\n", 
-               i, thread_data[i].start, thread_data[i].end);
+        printf("Creating thread %d for range %llu-%llu\n", i,
+               (unsigned long long)thread_data[i].start,
+               (unsigned long long)thread_data[i].end);
         
         if (pthread_create(&threads[i], NULL, compute_partial_factorial, &thread_data[i]) != 0) {
             perror("pthread_create failed");
@@ -73,7 +80,6 @@ uint64_t factorial_multithreaded(int k, int pnum) {
         }
         
         current_start = thread_data[i].end + 1;
-        if (current_start > k) break;
     }
     
     for (int i = 0; i < pnum; i++) {
@@ -86,23 +92,141 @@ uint64_t factorial_multithreaded(int k, int pnum) {
     return partial_result;
 }
 
-uint64_t factorial_sequential(int k) {
-    uint64_t result = 1;
-    for (int i = 2; i <= k; i++) {
-        result = (result * i) % mod;
+uint64_t factorial_sequential(uint64_t k) {
+    uint64_t result = 1 % mod;
+    for (uint64_t i = 2; i <= k; i++) {
+        result = MulMod(result, i, mod);
     }
     return result;
 }
 
+double elapsed_ms(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 +
+           (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Times both engines on doubling k to locate where the block-shift engine
+// starts to win; FACT_FAST_CROSSOVER in factmod.h is set from this.
+int run_benchmark(uint64_t p) {
+    if (!IsPrime64(p)) {
+        printf("Error: --bench needs a prime --mod\n");
+        return 1;
+    }
+    printf("%12s %14s %14s\n", "k", "linear, ms", "fast, ms");
+    uint64_t crossover = 0;
+    for (uint64_t k = 1ULL << 12; k <= (1ULL << 26) && k <= (p - 1) / 2;
+         k <<= 1) {
+        struct timespec t0, t1, t2;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        uint64_t linear = RangeProductMod(2, k, p);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        uint64_t fast = FactorialModPrime(k, p);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        if (linear != fast) {
+            printf("ERROR: engines disagree at k=%llu\n", (unsigned long long)k);
+            return 1;
+        }
+        double linear_ms = elapsed_ms(&t0, &t1);
+        double fast_ms = elapsed_ms(&t1, &t2);
+        printf("%12llu %14.3f %14.3f\n", (unsigned long long)k, linear_ms,
+               fast_ms);
+        if (crossover == 0 && k >= FACT_FAST_CROSSOVER && fast_ms < linear_ms)
+            crossover = k;
+    }
+    if (crossover)
+        printf("Fast engine wins from k = %llu (configured crossover %llu)\n",
+               (unsigned long long)crossover,
+               (unsigned long long)FACT_FAST_CROSSOVER);
+    return 0;
+}
+
+int run_exact(uint64_t k, int pnum, bool hex, bool naive, const char *out_path) {
+    struct BigNum result;
+    BigInit(&result);
+    struct timespec t0, t1, t2;
+    
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ExactFactorial(k, pnum, &result);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    char *text = hex ? BigToHex(&result) : BigToDecimal(&result);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    
+    fprintf(stderr, "%llu! has %zu bits, %zu %s digits\n",
+            (unsigned long long)k, BigBitLength(&result), strlen(text),
+            hex ? "hex" : "decimal");
+    fprintf(stderr, "Product tree (%d threads): %.3fms\n", pnum,
+            elapsed_ms(&t0, &t1));
+    fprintf(stderr, "Conversion to %s: %.3fms\n", hex ? "hex" : "decimal",
+            elapsed_ms(&t1, &t2));
+    
+    int status = 0;
+    if (naive) {
+        struct BigNum check;
+        BigInit(&check);
+        struct timespec n0, n1;
+        clock_gettime(CLOCK_MONOTONIC, &n0);
+        ExactFactorialNaive(k, &check);
+        clock_gettime(CLOCK_MONOTONIC, &n1);
+        bool same = check.len == result.len &&
+                    memcmp(check.limb, result.limb,
+                           result.len * sizeof(uint32_t)) == 0;
+        fprintf(stderr, "Naive left-to-right: %.3fms (x%.1f slower), %s\n",
+                elapsed_ms(&n0, &n1),
+                elapsed_ms(&n0, &n1) / elapsed_ms(&t0, &t1),
+                same ? "results match" : "RESULTS DIFFER");
+        if (!same) status = 1;
+        BigFree(&check);
+    }
+    
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (out == NULL) {
+        perror("fopen");
+        status = 1;
+    } else {
+        fprintf(out, "%s\n", text);
+        if (out != stdout) fclose(out);
+    }
+    free(text);
+    BigFree(&result);
+    return status;
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: %s -k <number> --pnum=<threads> --mod=<modulus> "
+           "[--algo=auto|linear|fast] [--ckpt=<dir>] [--bench]\n", prog);
+    printf("       %s -k <number> --exact [--pnum=<threads>] [--hex] "
+           "[--out=<file>] [--naive]\n", prog);
+    printf("       %s --batch=<file|-> [--pnum=<threads>] "
+           "(lines of \"k mod\")\n", prog);
+    printf("Example: %s -k 10 --pnum=4 --mod=1000000007\n", prog);
+}
+
 int main(int argc, char *argv[]) {
-    int k = -1;
+    uint64_t k = 0;
+    bool has_k = false;
     int pnum = 1;
     uint64_t mod_value = 0;
+    enum FactAlgo algo = FACT_ALGO_AUTO;
+    bool bench = false;
+    const char *ckpt_dir = NULL;
+    const char *batch_path = NULL;
+    bool exact = false;
+    bool hex = false;
+    bool naive = false;
+    const char *out_path = NULL;
     
     static struct option long_options[] = {
         {"k", required_argument, 0, 'k'},
         {"pnum", required_argument, 0, 'p'},
         {"mod", required_argument, 0, 'm'},
+        {"algo", required_argument, 0, 'a'},
+        {"bench", no_argument, 0, 'b'},
+        {"ckpt", required_argument, 0, 'c'},
+        {"batch", required_argument, 0, 'B'},
+        {"exact", no_argument, 0, 'e'},
+        {"hex", no_argument, 0, 'x'},
+        {"naive", no_argument, 0, 'n'},
+        {"out", required_argument, 0, 'o'},
         {0, 0, 0, 0}
     };
     
@@ -112,11 +236,12 @@ int main(int argc, char *argv[]) {
     while ((c = getopt_long(argc, argv, "k:p:m:", long_options, &option_index)) != -1) {
         switch (c) {
             case 'k':
-                k = atoi(optarg);
-                if (k < 0) {
+                if (optarg[0] == '-') {
                     printf("Error: k must be non-negative\n");
                     return 1;
                 }
+                k = strtoull(optarg, NULL, 10);
+                has_k = true;
                 break;
             case 'p':
                 pnum = atoi(optarg);
@@ -132,30 +257,99 @@ int main(int argc, char *argv[]) {
                     return 1;
                 }
                 break;
+            case 'a':
+                if (!ParseFactAlgo(optarg, &algo)) {
+                    printf("Error: algo must be auto, linear or fast\n");
+                    return 1;
+                }
+                break;
+            case 'b':
+                bench = true;
+                break;
+            case 'c':
+                ckpt_dir = optarg;
+                break;
+            case 'B':
+                batch_path = optarg;
+                break;
+            case 'e':
+                exact = true;
+                break;
+            case 'x':
+                hex = true;
+                break;
+            case 'n':
+                naive = true;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
             default:
-                printf("Usage: %s -k <number> --pnum=<threads> --mod=<modulus>\n", argv[0]);
-                printf("Example: %s -k 10 --pnum=4 --mod=1000000007\n", argv[0]);
+                print_usage(argv[0]);
                 return 1;
         }
     }
     
-    if (k == -1 || mod_value == 0) {
-        printf("Usage: %s -k <number> --pnum=<threads> --mod=<modulus>\n", argv[0]);
-        printf("Example: %s -k 10 --pnum=4 --mod=1000000007\n", argv[0]);
+    if (bench && mod_value != 0) {
+        return run_benchmark(mod_value);
+    }
+    
+    if (batch_path != NULL) {
+        FILE *in = strcmp(batch_path, "-") == 0 ? stdin : fopen(batch_path, "r");
+        if (in == NULL) {
+            perror("fopen");
+            return 1;
+        }
+        int status = RunBatch(in, pnum, algo);
+        if (in != stdin) fclose(in);
+        return status;
+    }
+    
+    if (exact && has_k) {
+        return run_exact(k, pnum, hex, naive, out_path);
+    }
+    
+    if (!has_k || mod_value == 0) {
+        print_usage(argv[0]);
         return 1;
     }
     
     mod = mod_value;
     
-    printf("Computing %d! mod %llu using %d threads\n", 
-           k, (unsigned long long)mod, pnum);
+    if (algo == FACT_ALGO_FAST && !IsPrime64(mod)) {
+        printf("Warning: %llu is not prime, falling back to linear\n",
+               (unsigned long long)mod);
+    }
     
-    partial_result = 1;
+    uint64_t result;
+    struct CheckpointStore *store = NULL;
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (FactUseFast(k, mod, algo)) {
+        printf("Computing %llu! mod %llu with the fast prime engine\n",
+               (unsigned long long)k, (unsigned long long)mod);
+        result = FactorialModPrime(k, mod);
+    } else if (ckpt_dir != NULL &&
+               (store = CheckpointStoreFor(ckpt_dir, mod)) != NULL) {
+        printf("Computing %llu! mod %llu using %d threads from checkpoints\n",
+               (unsigned long long)k, (unsigned long long)mod, pnum);
+        result = k >= mod ? 0 : CheckpointRangeProduct(store, 1, k, pnum);
+    } else {
+        printf("Computing %llu! mod %llu using %d threads\n",
+               (unsigned long long)k, (unsigned long long)mod, pnum);
+        partial_result = 1;
+        result = factorial_multithreaded(k, pnum);
+    }
     
-    uint64_t result = factorial_multithreaded(k, pnum);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
     
-    printf("\nFinal result: %d! mod %llu = %llu\n", 
-           k, (unsigned long long)mod, (unsigned long long)result);
+    printf("\nFinal result: %llu! mod %llu = %llu\n", (unsigned long long)k,
+           (unsigned long long)mod, (unsigned long long)result);
+    printf("Time: %.3fms\n", elapsed_ms(&start, &finish));
+    if (store != NULL) {
+        CheckpointPrintStats(store);
+        CheckpointClose(store);
+    }
     
     if (k <= 20) { 
         uint64_t sequential_result = factorial_sequential(k);
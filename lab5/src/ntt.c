@@ -0,0 +1,83 @@
+#include "ntt.h"
+
+const uint32_t kNttPrimes[3] = {NTT_P0, NTT_P1, NTT_P2};
+
+// P0^-1 mod P1 and (P0 * P1)^-1 mod P2.
+#define NTT_INV_P0_MOD_P1 47450712u
+#define NTT_INV_P01_MOD_P2 115990628u
+
+static uint32_t PowMod32(uint32_t a, uint64_t e, uint32_t q) {
+  uint64_t result = 1, base = a;
+  while (e > 0) {
+    if (e & 1)
+      result = result * base % q;
+    base = base * base % q;
+    e >>= 1;
+  }
+  return (uint32_t)result;
+}
+
+// Inlined per prime so the compiler can strength-reduce the reductions.
+static inline __attribute__((always_inline)) void
+NttWithPrime(uint32_t *a, size_t n, bool invert, uint32_t *twiddles,
+             const uint32_t q) {
+  for (size_t i = 1, j = 0; i < n; i++) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      uint32_t tmp = a[i];
+      a[i] = a[j];
+      a[j] = tmp;
+    }
+  }
+
+  for (size_t len = 2; len <= n; len <<= 1) {
+    size_t half = len >> 1;
+    uint32_t w = PowMod32(3, (q - 1) / len, q);
+    if (invert)
+      w = PowMod32(w, q - 2, q);
+    twiddles[0] = 1;
+    for (size_t j = 1; j < half; j++)
+      twiddles[j] = (uint32_t)((uint64_t)twiddles[j - 1] * w % q);
+
+    for (size_t i = 0; i < n; i += len) {
+      for (size_t j = 0; j < half; j++) {
+        uint32_t u = a[i + j];
+        uint32_t v = (uint32_t)((uint64_t)a[i + j + half] * twiddles[j] % q);
+        a[i + j] = u + v >= q ? u + v - q : u + v;
+        a[i + j + half] = u >= v ? u - v : u + q - v;
+      }
+    }
+  }
+
+  if (invert) {
+    uint64_t n_inv = PowMod32((uint32_t)(n % q), q - 2, q);
+    for (size_t i = 0; i < n; i++)
+      a[i] = (uint32_t)(a[i] * n_inv % q);
+  }
+}
+
+void Ntt(uint32_t *a, size_t n, bool invert, uint32_t *twiddles, int prime) {
+  switch (prime) {
+  case 0:
+    NttWithPrime(a, n, invert, twiddles, NTT_P0);
+    break;
+  case 1:
+    NttWithPrime(a, n, invert, twiddles, NTT_P1);
+    break;
+  default:
+    NttWithPrime(a, n, invert, twiddles, NTT_P2);
+  }
+}
+
+unsigned __int128 NttCrt3(uint32_t r0, uint32_t r1, uint32_t r2) {
+  uint64_t t = (uint64_t)((r1 + NTT_P1 - r0 % NTT_P1) % NTT_P1) *
+               NTT_INV_P0_MOD_P1 % NTT_P1;
+  uint64_t x01 = r0 + (uint64_t)NTT_P0 * t;
+  uint64_t u = (x01 % NTT_P2 > r2 ? r2 + NTT_P2 - x01 % NTT_P2
+                                  : r2 - x01 % NTT_P2) *
+               (uint64_t)NTT_INV_P01_MOD_P2 % NTT_P2;
+  return x01 + (unsigned __int128)((uint64_t)NTT_P0 * NTT_P1) * u;
+}
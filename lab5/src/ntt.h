@@ -0,0 +1,24 @@
+#ifndef NTT_H
+#define NTT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Three NTT-friendly primes (primitive root 3); any exact convolution below
+// their product (~2^86) is recovered with NttCrt3. Transform lengths must be
+// powers of two up to 2^23.
+#define NTT_P0 998244353u
+#define NTT_P1 167772161u
+#define NTT_P2 469762049u
+#define NTT_MAX_LEN (1u << 23)
+
+extern const uint32_t kNttPrimes[3];
+
+// In-place transform modulo kNttPrimes[prime]; twiddles needs n / 2 words.
+void Ntt(uint32_t *a, size_t n, bool invert, uint32_t *twiddles, int prime);
+
+// Recovers the exact (< P0 * P1 * P2) value from its three residues.
+unsigned __int128 NttCrt3(uint32_t r0, uint32_t r1, uint32_t r2);
+
+#endif
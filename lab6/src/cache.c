@@ -0,0 +1,178 @@
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static size_t Hash(const struct FactorialArgs *key) {
+  uint64_t h = key->begin * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ key->end) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ key->mod) * 0x94d049bb133111ebULL;
+  return (size_t)(h ^ (h >> 31));
+}
+
+static bool SameKey(const struct FactorialArgs *a,
+                    const struct FactorialArgs *b) {
+  return a->begin == b->begin && a->end == b->end && a->mod == b->mod;
+}
+
+bool CacheInit(struct ResultCache *cache, size_t max_bytes) {
+  size_t per_entry = sizeof(struct CacheEntry) + sizeof(struct CacheEntry *);
+  size_t capacity = max_bytes / per_entry;
+  // The table gets the next power of two above capacity; shrink capacity
+  // until both fit the budget.
+  size_t nbuckets = 64;
+  while (nbuckets < capacity)
+    nbuckets *= 2;
+  while (capacity > 0 && capacity * sizeof(struct CacheEntry) +
+                                 nbuckets * sizeof(struct CacheEntry *) >
+                             max_bytes)
+    capacity--;
+
+  cache->buckets = calloc(nbuckets, sizeof(struct CacheEntry *));
+  if (cache->buckets == NULL)
+    return false;
+  cache->mask = nbuckets - 1;
+  cache->head = cache->tail = NULL;
+  cache->count = 0;
+  cache->capacity = capacity;
+  cache->stats = (struct CacheStats){0};
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->ready, NULL);
+  return true;
+}
+
+static struct CacheEntry **Find(struct ResultCache *cache,
+                                const struct FactorialArgs *key) {
+  struct CacheEntry **slot = &cache->buckets[Hash(key) & cache->mask];
+  while (*slot != NULL && !SameKey(&(*slot)->key, key))
+    slot = &(*slot)->chain;
+  return slot;
+}
+
+static void Unlink(struct ResultCache *cache, struct CacheEntry *e) {
+  if (e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    cache->head = e->next;
+  if (e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    cache->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void PushFront(struct ResultCache *cache, struct CacheEntry *e) {
+  e->prev = NULL;
+  e->next = cache->head;
+  if (cache->head != NULL)
+    cache->head->prev = e;
+  cache->head = e;
+  if (cache->tail == NULL)
+    cache->tail = e;
+}
+
+// Drops least recently used entries over capacity. Entries that still have
+// waiters are skipped: they read the value after waking up.
+static void Evict(struct ResultCache *cache) {
+  struct CacheEntry *e = cache->tail;
+  while (cache->count > cache->capacity && e != NULL) {
+    struct CacheEntry *prev = e->prev;
+    if (e->waiters == 0) {
+      Unlink(cache, e);
+      *Find(cache, &e->key) = e->chain;
+      free(e);
+      cache->count--;
+      cache->stats.evictions++;
+    }
+    e = prev;
+  }
+}
+
+bool CacheRangeProduct(struct ResultCache *cache,
+                       const struct FactorialArgs *args,
+                       bool (*compute)(const struct FactorialArgs *, void *,
+                                       uint64_t *),
+                       void *ctx, uint64_t *value) {
+  uint64_t terms = args->begin <= args->end ? args->end - args->begin + 1 : 0;
+  pthread_mutex_lock(&cache->lock);
+  struct CacheEntry *e;
+  while ((e = *Find(cache, args)) != NULL) {
+    if (e->ready) {
+      cache->stats.hits++;
+      Unlink(cache, e);
+      PushFront(cache, e);
+      break;
+    }
+    cache->stats.coalesced++;
+    e->waiters++;
+    while (!e->ready && !e->failed)
+      pthread_cond_wait(&cache->ready, &cache->lock);
+    e->waiters--;
+    if (e->ready)
+      break;
+    // Look again: another waiter may have started over already.
+    if (e->waiters == 0)
+      free(e);
+  }
+  if (e != NULL) {
+    *value = e->value;
+    cache->stats.terms_saved += terms;
+    if (e->waiters == 0)
+      Evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+  }
+
+  e = calloc(1, sizeof(*e));
+  if (e == NULL) {
+    pthread_mutex_unlock(&cache->lock);
+    return compute(args, ctx, value);
+  }
+  e->key = *args;
+  e->chain = cache->buckets[Hash(args) & cache->mask];
+  cache->buckets[Hash(args) & cache->mask] = e;
+  cache->count++;
+  cache->stats.misses++;
+  pthread_mutex_unlock(&cache->lock);
+
+  bool ok = compute(args, ctx, value);
+
+  pthread_mutex_lock(&cache->lock);
+  if (ok) {
+    e->value = *value;
+    e->ready = true;
+    PushFront(cache, e);
+    Evict(cache);
+  } else {
+    *Find(cache, args) = e->chain;
+    cache->count--;
+    e->failed = true;
+  }
+  pthread_cond_broadcast(&cache->ready);
+  if (!ok && e->waiters == 0)
+    free(e);
+  pthread_mutex_unlock(&cache->lock);
+  return ok;
+}
+
+void CacheGetStats(struct ResultCache *cache, struct CacheStats *stats,
+                   size_t *count) {
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  *count = cache->count;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void CachePrintStats(struct ResultCache *cache) {
+  struct CacheStats st;
+  size_t count;
+  CacheGetStats(cache, &st, &count);
+
+  uint64_t lookups = st.hits + st.coalesced + st.misses;
+  printf("Cache: %llu hits, %llu coalesced, %llu misses (hit rate %.1f%%), "
+         "%llu terms saved, %zu of %zu entries\n",
+         (unsigned long long)st.hits, (unsigned long long)st.coalesced,
+         (unsigned long long)st.misses,
+         lookups ? 100.0 * (st.hits + st.coalesced) / lookups : 0.0,
+         (unsigned long long)st.terms_saved, count, cache->capacity);
+}
@@ -0,0 +1,61 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+struct CacheEntry {
+  struct FactorialArgs key;
+  uint64_t value;
+  bool ready;  // false while the first requester is still computing it
+  bool failed; // the computation gave up; out of the table already
+  int waiters; // requesters blocked on this entry
+  struct CacheEntry *chain;      // next in the hash bucket
+  struct CacheEntry *prev, *next; // LRU order, ready entries only
+};
+
+struct CacheStats {
+  uint64_t hits;      // answered from a finished entry
+  uint64_t coalesced; // waited for an identical request in flight
+  uint64_t misses;    // computed here
+  uint64_t terms_saved;
+  uint64_t evictions;
+};
+
+// Bounded LRU of range products keyed by (begin, end, mod). Identical
+// requests that arrive while the first is being computed wait for it
+// instead of computing again.
+struct ResultCache {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct CacheEntry **buckets;
+  size_t mask;
+  struct CacheEntry *head, *tail; // most and least recently used
+  size_t count, capacity;
+  struct CacheStats stats;
+};
+
+// max_bytes bounds the entries and the hash table together; 0 keeps only
+// requests in flight, so identical ones are still coalesced.
+bool CacheInit(struct ResultCache *cache, size_t max_bytes);
+
+// Finds the product for args, from the cache, from an identical request
+// in flight, or by calling compute(args, ctx, value) and remembering the
+// answer. compute returns false when it gives up; nothing is cached then,
+// requests that were waiting on it compute it themselves, and this
+// returns false too.
+bool CacheRangeProduct(struct ResultCache *cache,
+                       const struct FactorialArgs *args,
+                       bool (*compute)(const struct FactorialArgs *, void *,
+                                       uint64_t *),
+                       void *ctx, uint64_t *value);
+
+void CacheGetStats(struct ResultCache *cache, struct CacheStats *stats,
+                   size_t *count);
+void CachePrintStats(struct ResultCache *cache);
+
+#endif
@@ -6,49 +6,30 @@
 
 #include <errno.h>
 #include <getopt.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <netinet/ip.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-
-struct Server {
-  char ip[255];
-  int port;
-};
-
-uint64_t MultModulo(uint64_t a, uint64_t b, uint64_t mod) {
-  uint64_t result = 0;
-  a = a % mod;
-  while (b > 0) {
-    if (b % 2 == 1)
-      result = (result + a) % mod;
-    a = (a * 2) % mod;
-    b /= 2;
-  }
-
-  return result % mod;
-}
 
-bool ConvertStringToUI64(const char *str, uint64_t *val) {
-  char *end = NULL;
-  unsigned long long i = strtoull(str, &end, 10);
-  if (errno == ERANGE) {
-    fprintf(stderr, "Out of uint64_t range: %s\n", str);
-    return false;
-  }
+#include "cluster.h"
+#include "common.h"
 
-  if (errno != 0)
-    return false;
+struct Answer {
+  bool done;
+  bool ok;
+  uint64_t residues[MAX_MOD_FACTORS];
+};
 
-  *val = i;
-  return true;
+static void OnAnswer(void *arg, uint64_t query, bool ok,
+                     const uint64_t *residues, int nfactors) {
+  struct Answer *answer = arg;
+  answer->done = true;
+  answer->ok = ok;
+  memcpy(answer->residues, residues, sizeof(uint64_t) * nfactors);
 }
 
 int main(int argc, char **argv) {
   uint64_t k = -1;
-  uint64_t mod = -1;
-  char servers[255] = {'\0'}; // TODO: explain why 255
+  uint64_t factors[MAX_MOD_FACTORS];
+  int nfactors = 0;
+  const char *servers_path = NULL;
+  struct ClusterOptions opts = CLUSTER_DEFAULT_OPTIONS;
 
   while (true) {
     int current_optind = optind ? optind : 1;
@@ -56,6 +37,11 @@ int main(int argc, char **argv) {
     static struct option options[] = {{"k", required_argument, 0, 0},
                                       {"mod", required_argument, 0, 0},
                                       {"servers", required_argument, 0, 0},
+                                      {"sched", required_argument, 0, 0},
+                                      {"timeout", required_argument, 0, 0},
+                                      {"retries", required_argument, 0, 0},
+                                      {"hedge", required_argument, 0, 0},
+                                      {"conns", required_argument, 0, 0},
                                       {0, 0, 0, 0}};
 
     int option_index = 0;
@@ -68,16 +54,58 @@ int main(int argc, char **argv) {
     case 0: {
       switch (option_index) {
       case 0:
-        ConvertStringToUI64(optarg, &k);
-        // TODO: your code here
+        if (!ConvertStringToUI64(optarg, &k) || k == (uint64_t)-1) {
+          fprintf(stderr, "k must be an unsigned number below 2^64 - 1\n");
+          return 1;
+        }
         break;
       case 1:
-        ConvertStringToUI64(optarg, &mod);
-        // TODO: your code here
+        // Either one modulus or a product of coprime word-sized factors,
+        // e.g. 18446744073709551557*18446744073709551533.
+        nfactors = ParseModFactors(optarg, factors, MAX_MOD_FACTORS);
+        if (nfactors == 0)
+          return 1;
         break;
       case 2:
-        // TODO: your code here
-        memcpy(servers, optarg, strlen(optarg));
+        servers_path = optarg;
+        break;
+      case 3:
+        if (strcmp(optarg, "static") == 0) {
+          opts.sched = CLUSTER_STATIC;
+        } else if (strcmp(optarg, "dynamic") == 0) {
+          opts.sched = CLUSTER_DYNAMIC;
+        } else {
+          fprintf(stderr, "sched must be static or dynamic\n");
+          return 1;
+        }
+        break;
+      case 4:
+        opts.timeout_ms = atof(optarg);
+        if (opts.timeout_ms < 0) {
+          fprintf(stderr, "timeout must be a number of milliseconds\n");
+          return 1;
+        }
+        break;
+      case 5:
+        opts.max_retries = atoi(optarg);
+        if (opts.max_retries < 0) {
+          fprintf(stderr, "retries must not be negative\n");
+          return 1;
+        }
+        break;
+      case 6:
+        opts.hedge_pct = atof(optarg);
+        if (opts.hedge_pct <= 0 || opts.hedge_pct >= 100) {
+          fprintf(stderr, "hedge must be a percentile between 0 and 100\n");
+          return 1;
+        }
+        break;
+      case 7:
+        opts.conns_per_server = atoi(optarg);
+        if (opts.conns_per_server <= 0) {
+          fprintf(stderr, "conns must be a positive number\n");
+          return 1;
+        }
         break;
       default:
         printf("Index %d is out of options\n", option_index);
@@ -92,72 +120,58 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (k == -1 || mod == -1 || !strlen(servers)) {
+  if (k == -1 || nfactors == 0 || servers_path == NULL) {
     fprintf(stderr, "Using: %s --k 1000 --mod 5 --servers /path/to/file\n",
             argv[0]);
+    fprintf(stderr, "       --mod m1*m2*... splits a large modulus into "
+                    "coprime factors\n");
+    fprintf(stderr, "       --sched dynamic hands out chunks to whichever "
+                    "server finishes first\n");
+    fprintf(stderr, "       --timeout ms drops a server whose request runs "
+                    "longer; --retries 3 resends its work elsewhere\n");
+    fprintf(stderr, "       --hedge 95 duplicates requests slower than the "
+                    "95th percentile to a second server\n");
+    fprintf(stderr, "       --conns 1 keeps that many connections open to "
+                    "each server\n");
     return 1;
   }
 
-  // TODO: for one server here, rewrite with servers from file
-  unsigned int servers_num = 1;
-  struct Server *to = malloc(sizeof(struct Server) * servers_num);
-  // TODO: delete this and parallel work between servers
-  to[0].port = 20001;
-  memcpy(to[0].ip, "127.0.0.1", sizeof("127.0.0.1"));
-
-  // TODO: work continiously, rewrite to make parallel
-  for (int i = 0; i < servers_num; i++) {
-    struct hostent *hostname = gethostbyname(to[i].ip);
-    if (hostname == NULL) {
-      fprintf(stderr, "gethostbyname failed with %s\n", to[i].ip);
-      exit(1);
-    }
-
-    struct sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_port = htons(to[i].port);
-    server.sin_addr.s_addr = *((unsigned long *)hostname->h_addr);
-
-    int sck = socket(AF_INET, SOCK_STREAM, 0);
-    if (sck < 0) {
-      fprintf(stderr, "Socket creation failed!\n");
-      exit(1);
-    }
-
-    if (connect(sck, (struct sockaddr *)&server, sizeof(server)) < 0) {
-      fprintf(stderr, "Connection failed\n");
-      exit(1);
-    }
-
-    // TODO: for one server
-    // parallel between servers
-    uint64_t begin = 1;
-    uint64_t end = k;
-
-    char task[sizeof(uint64_t) * 3];
-    memcpy(task, &begin, sizeof(uint64_t));
-    memcpy(task + sizeof(uint64_t), &end, sizeof(uint64_t));
-    memcpy(task + 2 * sizeof(uint64_t), &mod, sizeof(uint64_t));
-
-    if (send(sck, task, sizeof(task), 0) < 0) {
-      fprintf(stderr, "Send failed\n");
-      exit(1);
-    }
-
-    char response[sizeof(uint64_t)];
-    if (recv(sck, response, sizeof(response), 0) < 0) {
-      fprintf(stderr, "Recieve failed\n");
-      exit(1);
-    }
-
-    // TODO: from one server
-    // unite results
-    uint64_t answer = 0;
-    memcpy(&answer, response, sizeof(uint64_t));
-    printf("answer: %llu\n", answer);
+  struct Server *to = malloc(sizeof(struct Server) * MAX_SERVERS);
+  int servers_num = LoadServers(servers_path, to, MAX_SERVERS);
+  if (servers_num == 0)
+    return 1;
 
-    close(sck);
+  struct Cluster cluster;
+  if (!ClusterInit(&cluster, to, servers_num, &opts))
+    return 1;
+  // Servers added to the file while the query runs take new chunks, and
+  // removed ones finish what they have.
+  ClusterWatchServers(&cluster, servers_path);
+
+  struct Answer answer = {false};
+  ClusterSubmit(&cluster, 1, k, factors, nfactors, OnAnswer, &answer);
+  while (!answer.done)
+    ClusterPoll(&cluster, -1);
+  ClusterPrintStats(&cluster, stderr);
+  ClusterDestroy(&cluster);
+  if (!answer.ok) {
+    fprintf(stderr, "All servers failed\n");
+    return 1;
+  }
+  const uint64_t *residues = answer.residues;
+
+  if (nfactors == 1) {
+    printf("answer: %llu\n", (unsigned long long)residues[0]);
+  } else {
+    struct BigNum answer;
+    BigInit(&answer);
+    CrtCombine(residues, factors, nfactors, &answer);
+    char *text = BigToDecimal(&answer);
+    printf("answer: %s\n", text);
+    free(text);
+    BigFree(&answer);
   }
+
   free(to);
 
   return 0;
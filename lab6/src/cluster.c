@@ -0,0 +1,1248 @@
+#include "cluster.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "randarray.h"
+
+// Chunks a connection may have queued in dynamic mode; two keep it busy
+// while the next one is on the wire.
+#define DYNAMIC_DEPTH 2
+// Dynamic chunks are sized to take about this long on their server.
+#define TARGET_CHUNK_MS 20.0
+#define MIN_CHUNK_TERMS (1 << 16)
+// How often deadlines, hedges and reconnects are checked while they are
+// armed.
+#define TICK_MS 5
+// Hedging waits for this many finished requests before trusting the
+// latency distribution.
+#define MIN_HEDGE_SAMPLES 4
+// Backoff for a busy reply that does not say how long to wait.
+#define RETRY_AFTER_MS 10
+// A UDP request without a reply is sent again after this long, doubling
+// up to UDP_MAX_RTO_MS. Servers drop the copies of one still computing.
+#define UDP_RTO_MS 20.0
+#define UDP_MAX_RTO_MS 1000.0
+#define RECONNECT_MIN_MS 100.0
+#define RECONNECT_MAX_MS 10000.0
+#define MAX_EVENTS 64
+
+// An array reduction is a query with the seed as its one factor and
+// elements begin - 1 .. end - 1, so it is cut like a factorial.
+struct ClusterQuery {
+  uint64_t id;
+  uint64_t begin, end;
+  uint64_t factors[MAX_MOD_FACTORS];
+  uint64_t residues[MAX_MOD_FACTORS];
+  int nfactors;
+  bool reduce;
+  struct ArrayStats stats; // for a reduction
+  int jobs_left; // jobs created and not yet answered
+  // Dynamic mode cuts [begin, end] for each factor in turn from here;
+  // factor == nfactors once everything is handed out.
+  int factor;
+  uint64_t next;
+  bool failed;
+  bool reported;
+  ClusterCallback cb;
+  ClusterReduceCallback reduce_cb;
+  void *arg;
+  struct ClusterQuery *prev, *next_active;
+  struct ClusterQuery *next_feed;
+};
+
+// One chunk of one query for one factor. Slots are recycled; gen changes
+// on every reuse so stale attempts can tell their job is gone.
+struct ClusterJob {
+  uint32_t gen;
+  bool used;
+  bool hedged;
+  struct ClusterQuery *query;
+  int factor;
+  struct FactorialArgs args;
+  int live; // attempts on the wire that can still answer it
+  int retries;
+  bool parked;
+  double retry_at; // while parked
+  int next_free;
+};
+
+// One request on the wire. The request id is (gen << 32) | slot, so a
+// reply for a recycled slot is recognised and dropped.
+struct ClusterAttempt {
+  uint32_t gen;
+  bool used;
+  int job;
+  uint32_t job_gen;
+  bool abandoned; // timed out; whatever it still gets back is stale
+  struct ClusterLink *link;
+  double sent_ms;
+  double resend_ms, rto_ms; // UDP only
+  int next_free;
+};
+
+struct ClusterLink {
+  int server;
+  bool udp; // a connected datagram socket; every frame is one datagram
+  bool removed; // its server left; no new work and never reopened
+  int fd; // -1 while down
+  bool connected;
+  uint32_t events; // current epoll interest
+  double reconnect_at; // when a down link is tried again
+  double backoff_ms;
+  double busy_until; // the server asked for no new work before this
+  char *out;
+  size_t out_len, out_sent, out_cap;
+  char *in;
+  size_t in_len, in_cap;
+  int pending;         // requests sent and not yet answered
+  double rate;         // observed terms per ms, 0 before the first reply
+  double last_done_ms; // when the previous reply arrived
+  double busy_ms;
+  uint64_t terms_done;
+  uint64_t chunks, terms;
+};
+
+static double NowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void FailLink(struct Cluster *c, struct ClusterLink *link,
+                     const char *why);
+
+static bool LinkUp(const struct ClusterLink *link) { return link->fd >= 0; }
+
+static bool ServerRemoved(const struct Cluster *c, int server) {
+  return c->links[server * c->opts.conns_per_server].removed;
+}
+
+static void OpenLink(struct Cluster *c, struct ClusterLink *link) {
+  link->connected = false;
+  link->in_len = link->out_len = link->out_sent = 0;
+  const struct sockaddr_storage *addr = &c->addrs[link->server];
+  link->fd = socket(addr->ss_family, link->udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+  if (link->fd < 0 || fcntl(link->fd, F_SETFL, O_NONBLOCK) < 0) {
+    FailLink(c, link, "socket creation failed");
+    return;
+  }
+  // Requests are small frames written as soon as they are cut; Nagle would
+  // hold them behind the server's delayed ACK.
+  int one = 1;
+  if (addr->ss_family == AF_INET && !link->udp)
+    setsockopt(link->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // A Unix socket whose backlog is full fails with EAGAIN instead of
+  // waiting; it is retried like any other refused connection.
+  if (connect(link->fd, (const struct sockaddr *)addr,
+              c->addr_lens[link->server]) < 0 &&
+      errno != EINPROGRESS) {
+    FailLink(c, link, "connection failed");
+    return;
+  }
+  struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = link};
+  link->events = EPOLLOUT;
+  if (epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, link->fd, &ev) < 0)
+    FailLink(c, link, "epoll_ctl failed");
+}
+
+static void CloseLinkSocket(struct Cluster *c, struct ClusterLink *link) {
+  if (link->fd >= 0) {
+    epoll_ctl(c->epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+    close(link->fd);
+    link->fd = -1;
+  }
+}
+
+static void FlushLink(struct Cluster *c, struct ClusterLink *link) {
+  if (!LinkUp(link))
+    return;
+  while (link->connected && link->out_sent < link->out_len) {
+    // A datagram link sends one frame per datagram.
+    size_t len = link->out_len - link->out_sent;
+    if (link->udp)
+      len = (size_t)FrameLength(link->out + link->out_sent, len);
+    ssize_t n = send(link->fd, link->out + link->out_sent, len, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n < 0 && errno != EINTR) {
+      FailLink(c, link, "send failed");
+      return;
+    }
+    if (n > 0)
+      link->out_sent += (size_t)n;
+  }
+  if (link->out_sent == link->out_len)
+    link->out_len = link->out_sent = 0;
+
+  uint32_t events = EPOLLIN;
+  if (link->out_sent < link->out_len || !link->connected)
+    events |= EPOLLOUT;
+  if (events == link->events)
+    return;
+  link->events = events;
+  struct epoll_event ev = {.events = events, .data.ptr = link};
+  epoll_ctl(c->epoll_fd, EPOLL_CTL_MOD, link->fd, &ev);
+}
+
+static bool GrowSlots(void **table, int *cap, size_t item) {
+  int new_cap = *cap ? *cap * 2 : 64;
+  void *p = realloc(*table, item * new_cap);
+  if (p == NULL)
+    return false;
+  memset((char *)p + item * *cap, 0, item * (new_cap - *cap));
+  *table = p;
+  *cap = new_cap;
+  return true;
+}
+
+static int AllocJob(struct Cluster *c) {
+  if (c->free_job < 0) {
+    int old = c->jobs_cap;
+    if (!GrowSlots((void **)&c->jobs, &c->jobs_cap, sizeof(*c->jobs)))
+      return -1;
+    for (int i = c->jobs_cap - 1; i >= old; i--) {
+      c->jobs[i].next_free = c->free_job;
+      c->free_job = i;
+    }
+  }
+  int j = c->free_job;
+  struct ClusterJob *job = &c->jobs[j];
+  c->free_job = job->next_free;
+  uint32_t gen = job->gen + 1;
+  memset(job, 0, sizeof(*job));
+  job->gen = gen;
+  job->used = true;
+  return j;
+}
+
+static void FreeJob(struct Cluster *c, int j) {
+  if (c->jobs[j].parked)
+    c->parked--;
+  c->jobs[j].used = false;
+  c->jobs[j].gen++;
+  c->jobs[j].next_free = c->free_job;
+  c->free_job = j;
+}
+
+static int AllocAttempt(struct Cluster *c) {
+  if (c->free_attempt < 0) {
+    int old = c->attempts_cap;
+    if (!GrowSlots((void **)&c->attempts, &c->attempts_cap,
+                   sizeof(*c->attempts)))
+      return -1;
+    for (int i = c->attempts_cap - 1; i >= old; i--) {
+      // A UDP server replays answers by (address, id); start from the clock
+      // so a later client on the same port does not reuse an old id.
+      c->attempts[i].gen = (uint32_t)(NowMs() * 1000);
+      c->attempts[i].next_free = c->free_attempt;
+      c->free_attempt = i;
+    }
+  }
+  int id = c->free_attempt;
+  c->free_attempt = c->attempts[id].next_free;
+  c->attempts[id].gen++;
+  c->attempts[id].used = true;
+  c->attempts[id].abandoned = false;
+  c->attempts_used++;
+  return id;
+}
+
+static void FreeAttempt(struct Cluster *c, int id) {
+  c->attempts[id].used = false;
+  c->attempts[id].next_free = c->free_attempt;
+  c->free_attempt = id;
+  c->attempts_used--;
+}
+
+// The job an attempt still works for, or NULL once the job was answered,
+// failed or recycled.
+static struct ClusterJob *AttemptJob(struct Cluster *c,
+                                     const struct ClusterAttempt *a) {
+  struct ClusterJob *job = &c->jobs[a->job];
+  return !a->abandoned && job->used && job->gen == a->job_gen ? job : NULL;
+}
+
+// The server gives up on a request when the client would stop waiting
+// for it anyway.
+static uint32_t DeadlineMs(const struct Cluster *c) {
+  if (c->opts.timeout_ms <= 0)
+    return 0;
+  if (c->opts.timeout_ms >= UINT32_MAX)
+    return UINT32_MAX;
+  uint32_t ms = (uint32_t)c->opts.timeout_ms;
+  return ms < c->opts.timeout_ms ? ms + 1 : ms;
+}
+
+// Appends the request for attempt id to its link's output.
+static bool QueueRequest(struct Cluster *c, int id,
+                         const struct ClusterJob *job) {
+  struct ClusterAttempt *a = &c->attempts[id];
+  struct ClusterLink *link = a->link;
+  if (!GrowBuffer(&link->out, &link->out_cap,
+                  link->out_len + FrameSizeFor(1)))
+    return false;
+  uint64_t wire_id = (uint64_t)a->gen << 32 | (uint32_t)id;
+  char *frame = link->out + link->out_len;
+  const struct FactorialArgs *args = &job->args;
+  if (job->query->reduce) {
+    struct ArraySlice slice = {args->begin - 1, args->end,
+                               (uint32_t)args->mod};
+    link->out_len += EncodeReduce(frame, wire_id, &slice, DeadlineMs(c));
+  } else {
+    link->out_len += EncodeRanges(frame, wire_id, args, 1, DeadlineMs(c));
+  }
+  return true;
+}
+
+static bool SendAttempt(struct Cluster *c, struct ClusterLink *link, int j) {
+  int id = AllocAttempt(c);
+  if (id < 0)
+    return false;
+  struct ClusterJob *job = &c->jobs[j];
+  struct ClusterAttempt *a = &c->attempts[id];
+  a->link = link;
+  if (!QueueRequest(c, id, job)) {
+    FreeAttempt(c, id);
+    return false;
+  }
+  a->job = j;
+  a->job_gen = job->gen;
+  a->sent_ms = NowMs();
+  a->rto_ms = UDP_RTO_MS;
+  a->resend_ms = a->sent_ms + a->rto_ms;
+  job->live++;
+  link->pending++;
+  c->stats.requests++;
+  return true;
+}
+
+static bool LinkBusy(const struct ClusterLink *link, double now) {
+  return now < link->busy_until;
+}
+
+// The live connection with the least queued work, skipping one server and
+// those that said they are busy.
+static struct ClusterLink *PickLink(struct Cluster *c, int exclude_server) {
+  struct ClusterLink *best = NULL;
+  double now = NowMs();
+  for (int i = 0; i < c->nlinks; i++) {
+    struct ClusterLink *link = &c->links[i];
+    if (!LinkUp(link) || link->removed || LinkBusy(link, now) ||
+        link->server == exclude_server)
+      continue;
+    if (best == NULL || link->pending < best->pending ||
+        (link->pending == best->pending && link->rate > best->rate))
+      best = link;
+  }
+  return best;
+}
+
+static struct ClusterLink *ServerLink(struct Cluster *c, int server) {
+  struct ClusterLink *best = NULL;
+  int per = c->opts.conns_per_server;
+  double now = NowMs();
+  for (int i = server * per; i < (server + 1) * per; i++) {
+    struct ClusterLink *link = &c->links[i];
+    if (LinkUp(link) && !link->removed && !LinkBusy(link, now) &&
+        (best == NULL || link->pending < best->pending))
+      best = link;
+  }
+  return best;
+}
+
+static void FinishQueryIfDone(struct Cluster *c, struct ClusterQuery *q) {
+  if (!q->reported && q->jobs_left == 0 && q->factor == q->nfactors) {
+    q->reported = true;
+    c->pending_queries--;
+  }
+}
+
+// Only the head of the feed is ever being cut, so it is the only query
+// that can leave the feed.
+static void PopFeed(struct Cluster *c, struct ClusterQuery *q) {
+  if (c->feed_head != q)
+    return;
+  c->feed_head = q->next_feed;
+  if (c->feed_head == NULL)
+    c->feed_tail = NULL;
+}
+
+static void FailQuery(struct Cluster *c, struct ClusterQuery *q) {
+  if (q->failed || q->reported)
+    return;
+  q->failed = true;
+  for (int j = 0; j < c->jobs_cap; j++) {
+    if (c->jobs[j].used && c->jobs[j].query == q)
+      FreeJob(c, j);
+  }
+  q->jobs_left = 0;
+  q->factor = q->nfactors;
+  PopFeed(c, q);
+  FinishQueryIfDone(c, q);
+}
+
+// When every server still up is busy, job j waits for the first of them
+// to take work again.
+static bool ParkJob(struct Cluster *c, int j) {
+  double wake = 0;
+  for (int i = 0; i < c->nlinks; i++) {
+    struct ClusterLink *link = &c->links[i];
+    if (LinkUp(link) && !link->removed &&
+        (wake == 0 || link->busy_until < wake))
+      wake = link->busy_until;
+  }
+  if (wake == 0)
+    return false;
+  c->jobs[j].parked = true;
+  c->jobs[j].retry_at = wake;
+  c->parked++;
+  return true;
+}
+
+// Sends job j to the least loaded server, preferably not failed_server.
+static void PlaceJob(struct Cluster *c, int j, int failed_server) {
+  struct ClusterJob *job = &c->jobs[j];
+  struct ClusterQuery *q = job->query;
+  struct ClusterLink *link = PickLink(c, failed_server);
+  if (link == NULL)
+    link = PickLink(c, -1);
+  if (link == NULL && ParkJob(c, j))
+    return;
+  if (link == NULL || !SendAttempt(c, link, j)) {
+    fprintf(stderr, "No server left for %llu..%llu\n",
+            (unsigned long long)job->args.begin,
+            (unsigned long long)job->args.end);
+    FailQuery(c, q);
+    return;
+  }
+  FlushLink(c, link);
+}
+
+// Sends job j elsewhere after its last attempt was lost or turned away.
+static void Retry(struct Cluster *c, int j, int failed_server) {
+  struct ClusterJob *job = &c->jobs[j];
+  if (++job->retries > c->opts.max_retries) {
+    fprintf(stderr, "Giving up on %llu..%llu after %d retries\n",
+            (unsigned long long)job->args.begin,
+            (unsigned long long)job->args.end, c->opts.max_retries);
+    FailQuery(c, job->query);
+    return;
+  }
+  c->stats.retries++;
+  PlaceJob(c, j, failed_server);
+}
+
+// Takes a connection down: everything it still owed is sent elsewhere and
+// the connection is retried later with exponential backoff.
+static void FailLink(struct Cluster *c, struct ClusterLink *link,
+                     const char *why) {
+  char name[sizeof(c->servers->ip) + 16];
+  FormatServer(&c->servers[link->server], name, sizeof(name));
+  if (link->removed)
+    fprintf(stderr, "%s: %s\n", name, why);
+  else
+    fprintf(stderr, "%s: %s, reconnecting in %.0f ms\n", name, why,
+            link->backoff_ms);
+  CloseLinkSocket(c, link);
+  link->reconnect_at = NowMs() + link->backoff_ms;
+  link->backoff_ms = link->backoff_ms * 2 < RECONNECT_MAX_MS
+                         ? link->backoff_ms * 2
+                         : RECONNECT_MAX_MS;
+  link->pending = 0;
+  link->in_len = link->out_len = link->out_sent = 0;
+
+  for (int id = 0; id < c->attempts_cap; id++) {
+    struct ClusterAttempt *a = &c->attempts[id];
+    if (!a->used || a->link != link)
+      continue;
+    struct ClusterJob *job = AttemptJob(c, a);
+    int j = a->job;
+    FreeAttempt(c, id);
+    if (job != NULL && --job->live == 0)
+      Retry(c, j, link->server);
+  }
+}
+
+static void RecordSample(struct Cluster *c, double ms_per_term) {
+  c->samples[c->nsamples % CLUSTER_HEDGE_SAMPLES] = ms_per_term;
+  c->nsamples++;
+  c->hedge_ms_per_term = -1;
+}
+
+static int CompareDouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double HedgeMsPerTerm(struct Cluster *c) {
+  if (c->hedge_ms_per_term < 0) {
+    int n = c->nsamples < CLUSTER_HEDGE_SAMPLES ? c->nsamples : CLUSTER_HEDGE_SAMPLES;
+    double sorted[CLUSTER_HEDGE_SAMPLES];
+    memcpy(sorted, c->samples, sizeof(double) * n);
+    qsort(sorted, n, sizeof(double), CompareDouble);
+    c->hedge_ms_per_term = sorted[(int)(c->opts.hedge_pct / 100 * (n - 1))];
+  }
+  return c->hedge_ms_per_term;
+}
+
+// Appends a FRAME_CANCEL for attempt id to its link's output.
+static bool QueueCancel(struct Cluster *c, int id) {
+  struct ClusterAttempt *a = &c->attempts[id];
+  struct ClusterLink *link = a->link;
+  if (!LinkUp(link) || !GrowBuffer(&link->out, &link->out_cap,
+                                   link->out_len + FRAME_HEADER_SIZE))
+    return false;
+  uint64_t wire_id = (uint64_t)a->gen << 32 | (uint32_t)id;
+  link->out_len += EncodeCancel(link->out + link->out_len, wire_id);
+  return true;
+}
+
+// Asks the servers still working on other copies of job j, which was just
+// answered, to stop. Their replies are stale and dropped when they come.
+static void CancelCopies(struct Cluster *c, int j, uint32_t job_gen,
+                         const struct ClusterLink *winner) {
+  for (int id = 0; id < c->attempts_cap; id++) {
+    struct ClusterAttempt *a = &c->attempts[id];
+    struct ClusterLink *link = a->link;
+    if (!a->used || a->abandoned || a->job != j || a->job_gen != job_gen ||
+        !QueueCancel(c, id))
+      continue;
+    c->stats.cancels++;
+    // The winner's link is in the middle of StepLink, which flushes it.
+    if (link != winner)
+      FlushLink(c, link);
+  }
+}
+
+// stats is the answer to a reduction, NULL for a product.
+static void FinishAttempt(struct Cluster *c, int id, uint64_t result,
+                          const struct ArrayStats *stats) {
+  struct ClusterAttempt *a = &c->attempts[id];
+  struct ClusterLink *link = a->link;
+  struct ClusterJob *job = AttemptJob(c, a);
+  double sent_ms = a->sent_ms;
+  link->pending--;
+  FreeAttempt(c, id);
+  if (job == NULL) {
+    c->stats.wasted++; // lost a hedge race or its query failed
+    return;
+  }
+
+  // Pipelined chunks queue behind each other, so the service time of this
+  // one starts when the previous reply came back, not when it was sent.
+  // Replies that arrive in one burst make single samples meaningless, so
+  // the rate is taken over everything the link has done so far.
+  double now = NowMs();
+  uint64_t terms = job->args.end - job->args.begin + 1;
+  double start = sent_ms > link->last_done_ms ? sent_ms : link->last_done_ms;
+  link->busy_ms += now - start;
+  link->terms_done += terms;
+  if (link->busy_ms > 0)
+    link->rate = link->terms_done / link->busy_ms;
+  link->last_done_ms = now;
+  RecordSample(c, (now - sent_ms) / terms);
+
+  // Freeing the job turns any hedged copy still on the wire stale, and
+  // CancelCopies stops it on its server.
+  struct ClusterQuery *q = job->query;
+  int f = job->factor;
+  if (q->reduce != (stats != NULL)) {
+    fprintf(stderr, "Server answered with the wrong reply type\n");
+    FailQuery(c, q);
+    return;
+  }
+  if (q->reduce)
+    MergeArrayStats(&q->stats, stats);
+  else
+    q->residues[f] = MultModulo(q->residues[f], result, q->factors[f]);
+  q->jobs_left--;
+  int j = (int)(job - c->jobs);
+  uint32_t job_gen = job->gen;
+  bool hedged = job->hedged;
+  FreeJob(c, j);
+  if (hedged)
+    CancelCopies(c, j, job_gen, link);
+  FinishQueryIfDone(c, q);
+}
+
+// Cuts the next dynamic chunk for the link from the oldest query that
+// still has work, sized from the link's measured throughput and capped so
+// the last chunks split evenly across connections.
+static bool QueueNextChunk(struct Cluster *c, struct ClusterLink *link) {
+  struct ClusterQuery *q = c->feed_head;
+  if (q == NULL)
+    return false;
+
+  uint64_t k = q->end - q->begin + 1;
+  uint64_t left = q->end - q->next + 1 +
+                  (uint64_t)(q->nfactors - q->factor - 1) * k;
+  uint64_t size = link->rate > 0 ? (uint64_t)(link->rate * TARGET_CHUNK_MS)
+                                 : MIN_CHUNK_TERMS;
+  uint64_t nlinks = (uint64_t)c->nactive * c->opts.conns_per_server;
+  if (size > left / (2 * nlinks))
+    size = left / (2 * nlinks);
+  if (size < MIN_CHUNK_TERMS)
+    size = MIN_CHUNK_TERMS;
+  if (size > q->end - q->next + 1)
+    size = q->end - q->next + 1;
+
+  int j = AllocJob(c);
+  if (j < 0)
+    return false;
+  struct ClusterJob *job = &c->jobs[j];
+  job->query = q;
+  job->factor = q->factor;
+  job->args = (struct FactorialArgs){q->next, q->next + size - 1,
+                                     q->factors[q->factor]};
+  if (!SendAttempt(c, link, j)) {
+    FreeJob(c, j);
+    return false;
+  }
+  q->jobs_left++;
+  link->chunks++;
+  link->terms += size;
+  q->next += size;
+  if (q->next > q->end) {
+    q->factor++;
+    q->next = q->begin;
+    if (q->factor == q->nfactors)
+      PopFeed(c, q);
+  }
+  return true;
+}
+
+static void Refill(struct Cluster *c, struct ClusterLink *link) {
+  while (c->opts.sched == CLUSTER_DYNAMIC && LinkUp(link) && !link->removed &&
+         !LinkBusy(link, NowMs()) && link->pending < DYNAMIC_DEPTH &&
+         QueueNextChunk(c, link))
+    ;
+  FlushLink(c, link);
+}
+
+// A full server answers PROTO_ERR_BUSY with how long to leave it alone;
+// none of its connections gets new work until then.
+static void MarkBusy(struct Cluster *c, int server, uint32_t retry_after_ms) {
+  double until = NowMs() + retry_after_ms;
+  int per = c->opts.conns_per_server;
+  for (int i = server * per; i < (server + 1) * per; i++) {
+    if (c->links[i].busy_until < until)
+      c->links[i].busy_until = until;
+  }
+  c->stats.busy++;
+}
+
+// Advances a link as far as its socket allows and folds every reply that
+// arrived into its query.
+static void StepLink(struct Cluster *c, struct ClusterLink *link) {
+  if (!LinkUp(link))
+    return;
+  if (!link->connected) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+      FailLink(c, link, "connection failed");
+      return;
+    }
+    link->connected = true;
+    link->backoff_ms = RECONNECT_MIN_MS;
+  }
+
+  while (true) {
+    if (!GrowBuffer(&link->in, &link->in_cap, link->in_len + 4096)) {
+      FailLink(c, link, "out of memory");
+      return;
+    }
+    ssize_t n = recv(link->fd, link->in + link->in_len, 4096, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n < 0 && errno == EINTR)
+      continue;
+    // A datagram is kept only if it is exactly one frame; a refused port
+    // still fails the link below.
+    if (link->udp && n >= 0) {
+      if (FrameLength(link->in + link->in_len, (size_t)n) == n)
+        link->in_len += (size_t)n;
+      continue;
+    }
+    if (n <= 0) {
+      FailLink(c, link, n == 0 ? "server closed the connection"
+                               : "receive failed");
+      return;
+    }
+    link->in_len += (size_t)n;
+  }
+
+  size_t used = 0;
+  long len;
+  while ((len = FrameLength(link->in + used, link->in_len - used)) > 0) {
+    struct FrameHeader header;
+    uint64_t result;
+    struct ArrayStats stats;
+    DecodeHeader(link->in + used, &header);
+    uint32_t id = (uint32_t)header.id;
+    struct ClusterAttempt *a = id < (uint32_t)c->attempts_cap
+                                   ? &c->attempts[id]
+                                   : NULL;
+    if (a == NULL || !a->used || a->gen != header.id >> 32 ||
+        a->link != link) {
+      if (link->udp) { // the answer to a retransmitted copy
+        used += (size_t)len;
+        continue;
+      }
+      FailLink(c, link, "reply to an unknown request");
+      return;
+    }
+    if (header.type == FRAME_ERROR) {
+      struct ClusterJob *job = AttemptJob(c, a);
+      uint32_t code = GetU32(link->in + used + FRAME_HEADER_SIZE);
+      int j = a->job;
+      link->pending--;
+      FreeAttempt(c, (int)id);
+      if (code == PROTO_ERR_BUSY)
+        MarkBusy(c, link->server,
+                 header.length >= FRAME_HEADER_SIZE + 2 * sizeof(uint32_t)
+                     ? GetU32(link->in + used + FRAME_HEADER_SIZE + 4)
+                     : RETRY_AFTER_MS);
+      // Neither says anything about the server's health, only that it could
+      // not do this request in time.
+      if ((code == PROTO_ERR_EXPIRED || code == PROTO_ERR_BUSY) &&
+          job != NULL) {
+        if (--job->live == 0)
+          Retry(c, j, link->server);
+      } else if (job != NULL) {
+        fprintf(stderr, "Server rejected request with error %u\n", code);
+        FailQuery(c, job->query);
+      }
+    } else if (DecodeStats(link->in + used, &header, &stats)) {
+      FinishAttempt(c, (int)id, 0, &stats);
+    } else if (DecodeResults(link->in + used, &header, &result, 1) == 1) {
+      FinishAttempt(c, (int)id, result, NULL);
+    } else {
+      FailLink(c, link, "malformed reply");
+      return;
+    }
+    used += (size_t)len;
+  }
+  if (len < 0) {
+    FailLink(c, link, "malformed reply");
+    return;
+  }
+  memmove(link->in, link->in + used, link->in_len - used);
+  link->in_len -= used;
+  // A removed server is let go once it has answered everything.
+  if (link->removed && link->pending == 0) {
+    CloseLinkSocket(c, link);
+    return;
+  }
+  Refill(c, link);
+}
+
+// Gives up on attempt id once it outlived the timeout: its server is asked
+// to stop and the job goes elsewhere, while the link and everything else
+// pipelined on it carry on.
+static void AbandonAttempt(struct Cluster *c, int id) {
+  struct ClusterAttempt *a = &c->attempts[id];
+  struct ClusterLink *link = a->link;
+  struct ClusterJob *job = AttemptJob(c, a);
+  int j = a->job;
+  a->abandoned = true;
+  QueueCancel(c, id);
+  c->stats.timeouts++;
+  if (job != NULL && --job->live == 0)
+    Retry(c, j, link->server);
+  FlushLink(c, link);
+}
+
+// Reopens links whose backoff ran out, gives up on requests that outlived
+// the timeout, takes down links that do not even answer those, and hedges
+// requests slower than the configured percentile of their peers.
+static void CheckTimers(struct Cluster *c) {
+  double now = NowMs();
+  for (int i = 0; i < c->nlinks; i++) {
+    struct ClusterLink *link = &c->links[i];
+    if (!LinkUp(link) && !link->removed && now >= link->reconnect_at) {
+      c->stats.reconnects++;
+      OpenLink(c, link);
+      if (LinkUp(link))
+        Refill(c, link);
+    }
+    if (link->busy_until > 0 && now >= link->busy_until) {
+      link->busy_until = 0;
+      Refill(c, link);
+    }
+  }
+  for (int j = 0; j < c->jobs_cap && c->parked > 0; j++) {
+    if (c->jobs[j].used && c->jobs[j].parked && now >= c->jobs[j].retry_at) {
+      c->jobs[j].parked = false;
+      c->parked--;
+      PlaceJob(c, j, -1);
+    }
+  }
+
+  bool can_hedge = c->opts.hedge_pct > 0 && c->nsamples >= MIN_HEDGE_SAMPLES;
+  if (c->opts.timeout_ms <= 0 && !can_hedge && !c->udp)
+    return;
+  int end = c->attempts_cap;
+  for (int id = 0; id < end; id++) {
+    struct ClusterAttempt a = c->attempts[id];
+    if (!a.used || !LinkUp(a.link))
+      continue;
+    double elapsed = now - a.sent_ms;
+    // The cancel was lost with its datagram, or the server is stuck.
+    if (a.abandoned && elapsed > 2 * c->opts.timeout_ms) {
+      if (a.link->udp) {
+        a.link->pending--;
+        FreeAttempt(c, id);
+      } else {
+        FailLink(c, a.link, "request timed out");
+      }
+      continue;
+    }
+    struct ClusterJob *job = AttemptJob(c, &a);
+    if (job == NULL)
+      continue;
+    if (c->opts.timeout_ms > 0 && elapsed > c->opts.timeout_ms) {
+      AbandonAttempt(c, id);
+      continue;
+    }
+    if (a.link->udp && now >= a.resend_ms && QueueRequest(c, id, job)) {
+      struct ClusterAttempt *sent = &c->attempts[id];
+      sent->rto_ms = sent->rto_ms * 2 < UDP_MAX_RTO_MS ? sent->rto_ms * 2
+                                                       : UDP_MAX_RTO_MS;
+      sent->resend_ms = now + sent->rto_ms;
+      c->stats.retransmits++;
+      FlushLink(c, a.link);
+    }
+    uint64_t terms = job->args.end - job->args.begin + 1;
+    if (can_hedge && !job->hedged && job->live == 1 &&
+        elapsed > HedgeMsPerTerm(c) * terms) {
+      struct ClusterLink *link = PickLink(c, a.link->server);
+      if (link == NULL || !SendAttempt(c, link, a.job))
+        continue;
+      c->jobs[a.job].hedged = true;
+      c->stats.hedges++;
+      FlushLink(c, link);
+    }
+  }
+}
+
+static bool ResolveServer(struct Cluster *c, int i,
+                          const struct Server *server) {
+  memset(&c->addrs[i], 0, sizeof(c->addrs[i]));
+  if (server->port == 0) {
+    struct sockaddr_un *un = (struct sockaddr_un *)&c->addrs[i];
+    un->sun_family = AF_UNIX;
+    strncpy(un->sun_path, server->ip, sizeof(un->sun_path) - 1);
+    c->addr_lens[i] = sizeof(*un);
+    return true;
+  }
+  struct hostent *hostname = gethostbyname(server->ip);
+  if (hostname == NULL) {
+    fprintf(stderr, "gethostbyname failed with %s\n", server->ip);
+    return false;
+  }
+  struct sockaddr_in *in = (struct sockaddr_in *)&c->addrs[i];
+  in->sin_family = AF_INET;
+  in->sin_port = htons(server->port);
+  memcpy(&in->sin_addr, hostname->h_addr, sizeof(in->sin_addr));
+  c->addr_lens[i] = sizeof(*in);
+  return true;
+}
+
+// A slot whose removed server has closed every connection, or a new one.
+static int FreeServerSlot(const struct Cluster *c) {
+  int per = c->opts.conns_per_server;
+  for (int i = 0; i < c->nservers; i++) {
+    bool closed = ServerRemoved(c, i);
+    for (int l = i * per; l < (i + 1) * per && closed; l++)
+      closed = !LinkUp(&c->links[l]);
+    if (closed)
+      return i;
+  }
+  return c->nservers < MAX_SERVERS ? c->nservers : -1;
+}
+
+static bool AddServer(struct Cluster *c, const struct Server *server) {
+  int i = FreeServerSlot(c);
+  if (i < 0) {
+    fprintf(stderr, "At most %d servers are supported\n", MAX_SERVERS);
+    return false;
+  }
+  if (!ResolveServer(c, i, server))
+    return false;
+  int per = c->opts.conns_per_server;
+  if (i == c->nservers) {
+    c->nservers++;
+    c->nlinks = c->nservers * per;
+  }
+  c->servers[i] = *server;
+  c->nactive++;
+  c->total_weight += server->weight;
+  c->udp = c->udp || server->udp;
+  for (int l = i * per; l < (i + 1) * per; l++) {
+    struct ClusterLink *link = &c->links[l];
+    free(link->out);
+    free(link->in);
+    memset(link, 0, sizeof(*link));
+    link->server = i;
+    link->udp = server->udp;
+    link->fd = -1;
+    link->backoff_ms = RECONNECT_MIN_MS;
+    OpenLink(c, link);
+  }
+  return true;
+}
+
+static void RemoveServer(struct Cluster *c, int i) {
+  int per = c->opts.conns_per_server;
+  int draining = 0;
+  for (int l = i * per; l < (i + 1) * per; l++) {
+    struct ClusterLink *link = &c->links[l];
+    link->removed = true;
+    if (link->pending == 0)
+      CloseLinkSocket(c, link);
+    draining += link->pending;
+  }
+  c->nactive--;
+  c->total_weight -= c->servers[i].weight;
+  char name[sizeof(c->servers->ip) + 16];
+  FormatServer(&c->servers[i], name, sizeof(name));
+  fprintf(stderr, "%s: removed, draining %d requests\n", name, draining);
+}
+
+static bool SameServer(const struct Server *a, const struct Server *b) {
+  return a->port == b->port && a->udp == b->udp && strcmp(a->ip, b->ip) == 0;
+}
+
+bool ClusterSetServers(struct Cluster *c, const struct Server *servers,
+                       int nservers) {
+  bool kept[nservers > 0 ? nservers : 1];
+  memset(kept, 0, sizeof(kept));
+  for (int i = 0; i < c->nservers; i++) {
+    if (ServerRemoved(c, i))
+      continue;
+    int k = 0;
+    while (k < nservers &&
+           (kept[k] || !SameServer(&servers[k], &c->servers[i])))
+      k++;
+    if (k == nservers) {
+      RemoveServer(c, i);
+      continue;
+    }
+    kept[k] = true;
+    c->total_weight += servers[k].weight;
+    c->total_weight -= c->servers[i].weight;
+    c->servers[i].weight = servers[k].weight;
+  }
+  bool ok = true;
+  for (int k = 0; k < nservers; k++) {
+    if (!kept[k])
+      ok = AddServer(c, &servers[k]) && ok;
+  }
+  return ok;
+}
+
+bool ClusterInit(struct Cluster *c, const struct Server *servers,
+                 int nservers, const struct ClusterOptions *opts) {
+  memset(c, 0, sizeof(*c));
+  c->opts = *opts;
+  if (c->opts.conns_per_server < 1)
+    c->opts.conns_per_server = 1;
+  c->free_job = c->free_attempt = -1;
+  c->hedge_ms_per_term = -1;
+  c->watch_fd = -1;
+  c->servers = malloc(sizeof(struct Server) * MAX_SERVERS);
+  c->addrs = calloc(MAX_SERVERS, sizeof(struct sockaddr_storage));
+  c->addr_lens = malloc(sizeof(socklen_t) * MAX_SERVERS);
+  c->links = calloc((size_t)MAX_SERVERS * c->opts.conns_per_server,
+                    sizeof(struct ClusterLink));
+  c->epoll_fd = epoll_create1(0);
+  if (c->servers == NULL || c->addrs == NULL || c->addr_lens == NULL ||
+      c->links == NULL || c->epoll_fd < 0 ||
+      !ClusterSetServers(c, servers, nservers)) {
+    ClusterDestroy(c);
+    return false;
+  }
+  return true;
+}
+
+bool ClusterWatchServers(struct Cluster *c, const char *path) {
+  // Files are often replaced rather than rewritten, so the directory is
+  // watched and its events are picked by name.
+  c->watch_path = strdup(path);
+  if (c->watch_path == NULL)
+    return false;
+  char *slash = strrchr(c->watch_path, '/');
+  char dir[PATH_MAX];
+  if (slash == NULL) {
+    strcpy(dir, ".");
+    c->watch_name = c->watch_path;
+  } else {
+    snprintf(dir, sizeof(dir), "%.*s",
+             slash == c->watch_path ? 1 : (int)(slash - c->watch_path),
+             c->watch_path);
+    c->watch_name = slash + 1;
+  }
+  c->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+  if (c->watch_fd < 0 ||
+      inotify_add_watch(c->watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+      epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, c->watch_fd, &ev) < 0) {
+    fprintf(stderr, "Can not watch %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Applies the servers file if it changed. One that fails to parse, say
+// caught half written, leaves the servers as they are.
+static void ReloadServers(struct Cluster *c) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+  ssize_t n;
+  while ((n = read(c->watch_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      if (ev->len > 0 && strcmp(ev->name, c->watch_name) == 0)
+        changed = true;
+      p += sizeof(*ev) + ev->len;
+    }
+  }
+  if (!changed)
+    return;
+  struct Server *servers = malloc(sizeof(struct Server) * MAX_SERVERS);
+  int nservers =
+      servers != NULL ? LoadServers(c->watch_path, servers, MAX_SERVERS) : 0;
+  if (nservers > 0) {
+    ClusterSetServers(c, servers, nservers);
+    fprintf(stderr, "%s: now %d servers\n", c->watch_path, c->nactive);
+  }
+  free(servers);
+}
+
+void ClusterDestroy(struct Cluster *c) {
+  for (int i = 0; c->links != NULL && i < c->nlinks; i++) {
+    CloseLinkSocket(c, &c->links[i]);
+    free(c->links[i].out);
+    free(c->links[i].in);
+  }
+  while (c->active != NULL) {
+    struct ClusterQuery *next = c->active->next_active;
+    free(c->active);
+    c->active = next;
+  }
+  if (c->watch_fd >= 0)
+    close(c->watch_fd);
+  if (c->epoll_fd > 0)
+    close(c->epoll_fd);
+  free(c->watch_path);
+  free(c->links);
+  free(c->jobs);
+  free(c->attempts);
+  free(c->addrs);
+  free(c->addr_lens);
+  free(c->servers);
+  memset(c, 0, sizeof(*c));
+}
+
+// Static mode: every factor gets the whole range, cut at the cumulative
+// weights so each server's share matches its capacity.
+static void SplitStatic(struct Cluster *c, struct ClusterQuery *q) {
+  uint64_t k = q->end - q->begin + 1;
+  for (int f = 0; f < q->nfactors && !q->failed; f++) {
+    uint64_t next = q->begin, weight_sum = 0;
+    for (int i = 0; i < c->nservers && !q->failed; i++) {
+      if (ServerRemoved(c, i))
+        continue;
+      weight_sum += c->servers[i].weight;
+      uint64_t end = q->begin - 1 +
+                     (uint64_t)((unsigned __int128)k * weight_sum /
+                                c->total_weight);
+      if (end < next)
+        continue;
+      int j = AllocJob(c);
+      if (j < 0) {
+        FailQuery(c, q);
+        break;
+      }
+      c->jobs[j].query = q;
+      c->jobs[j].factor = f;
+      c->jobs[j].args = (struct FactorialArgs){next, end, q->factors[f]};
+      q->jobs_left++;
+      next = end + 1;
+
+      struct ClusterLink *link = ServerLink(c, i);
+      if (link != NULL && SendAttempt(c, link, j)) {
+        FlushLink(c, link);
+      } else {
+        PlaceJob(c, j, i);
+      }
+    }
+  }
+  q->factor = q->nfactors;
+}
+
+static struct ClusterQuery *NewQuery(struct Cluster *c, uint64_t begin,
+                                     uint64_t end, void *arg) {
+  struct ClusterQuery *q = calloc(1, sizeof(*q));
+  if (q == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  q->id = c->next_query++;
+  q->begin = begin;
+  q->end = end;
+  q->next = begin;
+  q->arg = arg;
+  return q;
+}
+
+static uint64_t StartQuery(struct Cluster *c, struct ClusterQuery *q) {
+  uint64_t begin = q->begin, end = q->end;
+  int nfactors = q->nfactors;
+  q->next_active = c->active;
+  if (c->active != NULL)
+    c->active->prev = q;
+  c->active = q;
+  c->pending_queries++;
+  c->stats.queries++;
+
+  if (begin > end)
+    q->factor = nfactors;
+  else if (c->opts.sched == CLUSTER_STATIC)
+    SplitStatic(c, q);
+  else {
+    q->next_feed = NULL;
+    if (c->feed_tail != NULL)
+      c->feed_tail->next_feed = q;
+    else
+      c->feed_head = q;
+    c->feed_tail = q;
+    for (int i = 0; i < c->nlinks; i++)
+      Refill(c, &c->links[i]);
+  }
+  FinishQueryIfDone(c, q);
+  return q->id;
+}
+
+uint64_t ClusterSubmit(struct Cluster *c, uint64_t begin, uint64_t end,
+                       const uint64_t *factors, int nfactors,
+                       ClusterCallback cb, void *arg) {
+  struct ClusterQuery *q = NewQuery(c, begin == 0 ? 1 : begin, end, arg);
+  q->nfactors = nfactors;
+  q->cb = cb;
+  for (int f = 0; f < nfactors; f++) {
+    q->factors[f] = factors[f];
+    q->residues[f] = 1 % factors[f];
+  }
+  return StartQuery(c, q);
+}
+
+uint64_t ClusterSubmitReduce(struct Cluster *c, uint32_t seed, uint64_t begin,
+                             uint64_t end, ClusterReduceCallback cb,
+                             void *arg) {
+  struct ClusterQuery *q = NewQuery(c, begin + 1, end, arg);
+  q->nfactors = 1;
+  q->factors[0] = seed;
+  q->reduce = true;
+  q->reduce_cb = cb;
+  return StartQuery(c, q);
+}
+
+// Runs the callbacks of every finished query and forgets them.
+static int ReportQueries(struct Cluster *c) {
+  int reported = 0;
+  struct ClusterQuery *q = c->active;
+  while (q != NULL) {
+    struct ClusterQuery *next = q->next_active;
+    if (q->reported) {
+      if (q->prev != NULL)
+        q->prev->next_active = q->next_active;
+      else
+        c->active = q->next_active;
+      if (q->next_active != NULL)
+        q->next_active->prev = q->prev;
+      if (q->failed)
+        c->stats.failed++;
+      if (q->cb != NULL)
+        q->cb(q->arg, q->id, !q->failed, q->residues, q->nfactors);
+      if (q->reduce_cb != NULL)
+        q->reduce_cb(q->arg, q->id, !q->failed, &q->stats);
+      free(q);
+      reported++;
+    }
+    q = next;
+  }
+  return reported;
+}
+
+int ClusterPoll(struct Cluster *c, int timeout_ms) {
+  int reported = ReportQueries(c);
+  if (reported > 0)
+    timeout_ms = 0;
+
+  bool timers = c->opts.timeout_ms > 0 || c->opts.hedge_pct > 0 ||
+                c->parked > 0 || (c->udp && c->attempts_used > 0);
+  for (int i = 0; i < c->nlinks && !timers; i++)
+    timers = (!LinkUp(&c->links[i]) && !c->links[i].removed) ||
+             c->links[i].busy_until > 0;
+  if (timers && (timeout_ms < 0 || timeout_ms > TICK_MS))
+    timeout_ms = TICK_MS;
+
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(c->epoll_fd, events, MAX_EVENTS, timeout_ms);
+  for (int i = 0; i < n; i++) {
+    if (events[i].data.ptr == c)
+      ReloadServers(c);
+    else
+      StepLink(c, events[i].data.ptr);
+  }
+  if (timers)
+    CheckTimers(c);
+  return reported + ReportQueries(c);
+}
+
+int ClusterPending(const struct Cluster *c) { return c->pending_queries; }
+
+int ClusterFd(const struct Cluster *c) { return c->epoll_fd; }
+
+void ClusterPrintStats(const struct Cluster *c, FILE *out) {
+  for (int i = 0; i < c->nlinks; i++) {
+    const struct ClusterLink *link = &c->links[i];
+    if (link->chunks == 0)
+      continue;
+    char name[sizeof(c->servers->ip) + 16];
+    FormatServer(&c->servers[link->server], name, sizeof(name));
+    fprintf(out, "%s: %llu chunks, %llu terms, %.0f terms/ms\n", name,
+            (unsigned long long)link->chunks, (unsigned long long)link->terms,
+            link->rate);
+  }
+  const struct ClusterStats *st = &c->stats;
+  if (st->hedges || st->retries || st->failed || st->reconnects ||
+      st->retransmits || st->timeouts)
+    fprintf(out,
+            "Hedged %llu, retried %llu, %llu timed out, %llu losers "
+            "cancelled, %llu answers wasted, %llu reconnects, %llu busy, "
+            "%llu retransmits, %llu of %llu queries failed\n",
+            (unsigned long long)st->hedges, (unsigned long long)st->retries,
+            (unsigned long long)st->timeouts,
+            (unsigned long long)st->cancels, (unsigned long long)st->wasted,
+            (unsigned long long)st->reconnects,
+            (unsigned long long)st->busy,
+            (unsigned long long)st->retransmits,
+            (unsigned long long)st->failed, (unsigned long long)st->queries);
+}
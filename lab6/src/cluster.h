@@ -0,0 +1,136 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "common.h"
+
+enum ClusterSched {
+  CLUSTER_STATIC,  // split each query once, by server weight
+  CLUSTER_DYNAMIC, // hand out chunks to whichever server finishes first
+};
+
+struct ClusterOptions {
+  enum ClusterSched sched;
+  int conns_per_server;
+  double timeout_ms; // 0 waits forever
+  int max_retries;
+  double hedge_pct; // 0 never hedges
+};
+
+#define CLUSTER_DEFAULT_OPTIONS {CLUSTER_STATIC, 1, 0, 3, 0}
+// Latest request latencies kept for the hedging percentile.
+#define CLUSTER_HEDGE_SAMPLES 256
+
+// Called once per query from ClusterPoll. ok is false when the query ran
+// out of retries or servers; residues[i] is then meaningless.
+typedef void (*ClusterCallback)(void *arg, uint64_t query, bool ok,
+                                const uint64_t *residues, int nfactors);
+
+// Called once per ClusterSubmitReduce query, like ClusterCallback.
+typedef void (*ClusterReduceCallback)(void *arg, uint64_t query, bool ok,
+                                      const struct ArrayStats *stats);
+
+struct ClusterLink;
+struct ClusterJob;
+struct ClusterAttempt;
+struct ClusterQuery;
+
+struct ClusterStats {
+  uint64_t queries, failed;
+  uint64_t requests, hedges, retries, wasted, reconnects;
+  uint64_t cancels; // losing hedge copies the client asked to stop
+  uint64_t timeouts; // requests given up on after timeout_ms
+  uint64_t busy; // requests a full server turned away
+  uint64_t retransmits; // UDP requests sent again
+};
+
+// A set of servers reached over persistent pipelined connections, each
+// resolved when it joins. Servers can be added and removed while queries
+// run. Everything runs on the caller's thread inside ClusterPoll; the
+// structure is not thread-safe.
+struct Cluster {
+  struct ClusterOptions opts;
+  struct Server *servers; // MAX_SERVERS slots
+  struct sockaddr_storage *addrs; // TCP, UDP or Unix
+  socklen_t *addr_lens;
+  int nservers; // slots in use, removed servers included
+  int nactive;  // servers not removed
+  bool udp; // some servers are reached over UDP
+  uint64_t total_weight;
+  int epoll_fd;
+  int watch_fd; // inotify on the servers file's directory, or -1
+  char *watch_path;
+  const char *watch_name; // the file's name within watch_path
+
+  // conns_per_server per slot, server-major. Links never move, so requests
+  // can point at them.
+  struct ClusterLink *links;
+  int nlinks; // links of the slots in use
+
+  struct ClusterJob *jobs;
+  int jobs_cap, free_job;
+  struct ClusterAttempt *attempts;
+  int attempts_cap, free_attempt, attempts_used;
+
+  struct ClusterQuery *active; // every query not yet reported
+  struct ClusterQuery *feed_head, *feed_tail; // dynamic: still being cut
+  int parked; // jobs waiting for a busy server to take work again
+  uint64_t next_query;
+  int pending_queries;
+
+  double samples[CLUSTER_HEDGE_SAMPLES]; // ms per term of finished requests
+  int nsamples;
+  double hedge_ms_per_term;
+
+  struct ClusterStats stats;
+};
+
+bool ClusterInit(struct Cluster *cluster, const struct Server *servers,
+                 int nservers, const struct ClusterOptions *opts);
+void ClusterDestroy(struct Cluster *cluster);
+
+// Makes servers the new membership. New servers get connections and, in
+// dynamic mode, chunks right away. A removed server gets no new work; what
+// it already has is drained, or sent elsewhere if its connection fails.
+// Returns false if a new server could not be added.
+bool ClusterSetServers(struct Cluster *cluster, const struct Server *servers,
+                       int nservers);
+
+// Reloads the servers file into ClusterSetServers from ClusterPoll whenever
+// it is rewritten or replaced.
+bool ClusterWatchServers(struct Cluster *cluster, const char *path);
+
+// Queues begin * ... * end modulo every factor (pairwise coprime, at most
+// MAX_MOD_FACTORS) and returns the query id passed to cb. Requests go out
+// as far as the sockets take them; the rest, and every answer, is handled
+// by ClusterPoll.
+uint64_t ClusterSubmit(struct Cluster *cluster, uint64_t begin, uint64_t end,
+                       const uint64_t *factors, int nfactors,
+                       ClusterCallback cb, void *arg);
+
+// Queues the min, max and sum of elements [begin, end) of the array lab4's
+// GenerateArray fills for seed. Each server generates its own part, so
+// nothing but the totals crosses the network.
+uint64_t ClusterSubmitReduce(struct Cluster *cluster, uint32_t seed,
+                             uint64_t begin, uint64_t end,
+                             ClusterReduceCallback cb, void *arg);
+
+// Waits up to timeout_ms (-1 forever, 0 not at all) for network events,
+// advances every connection and runs the callbacks of finished queries.
+// Returns the number of queries reported.
+int ClusterPoll(struct Cluster *cluster, int timeout_ms);
+
+// Queries submitted and not yet reported.
+int ClusterPending(const struct Cluster *cluster);
+
+// A descriptor that turns readable when ClusterPoll has work, for callers
+// that multiplex the cluster with their own sockets.
+int ClusterFd(const struct Cluster *cluster);
+
+void ClusterPrintStats(const struct Cluster *cluster, FILE *out);
+
+#endif
@@ -0,0 +1,188 @@
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+
+#include "factmod.h"
+
+uint64_t MultModulo(uint64_t a, uint64_t b, uint64_t mod) {
+  return (uint64_t)((unsigned __int128)a * b % mod);
+}
+
+bool ConvertStringToUI64(const char *str, uint64_t *val) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long long i = strtoull(str, &end, 10);
+  if (errno == ERANGE) {
+    fprintf(stderr, "Out of uint64_t range: %s\n", str);
+    return false;
+  }
+
+  if (errno != 0 || end == str)
+    return false;
+
+  *val = i;
+  return true;
+}
+
+static uint64_t Gcd(uint64_t a, uint64_t b) {
+  while (b != 0) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+int ParseModFactors(const char *str, uint64_t *factors, int max_factors) {
+  int n = 0;
+  const char *p = str;
+  while (*p) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(p, &end, 10);
+    if (end == p || errno == ERANGE || value < 2) {
+      fprintf(stderr, "Bad modulus factor in %s\n", str);
+      return 0;
+    }
+    if (n == max_factors) {
+      fprintf(stderr, "At most %d modulus factors are supported\n",
+              max_factors);
+      return 0;
+    }
+    for (int i = 0; i < n; i++) {
+      if (Gcd(factors[i], value) != 1) {
+        fprintf(stderr, "Modulus factors %llu and %llu are not coprime\n",
+                (unsigned long long)factors[i], value);
+        return 0;
+      }
+    }
+    factors[n++] = value;
+    if (*end == '*')
+      end++;
+    else if (*end != '\0') {
+      fprintf(stderr, "Bad modulus factor in %s\n", str);
+      return 0;
+    }
+    p = end;
+  }
+  return n;
+}
+
+int LoadServers(const char *path, struct Server *servers, int max_servers) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Can not open servers file %s\n", path);
+    return 0;
+  }
+
+  int n = 0, line_no = 0;
+  char line[512];
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), file) != NULL) {
+    line_no++;
+    char *hash = strchr(line, '#');
+    if (hash != NULL)
+      *hash = '\0';
+
+    char host_port[sizeof(line)];
+    unsigned long weight = 1;
+    char extra;
+    int fields = sscanf(line, "%511s %lu %c", host_port, &weight, &extra);
+    if (fields <= 0)
+      continue;
+
+    // "unix:/path" keeps the path in ip with port 0; it must fit a
+    // sockaddr_un.
+    const char *host = host_port;
+    size_t host_len = 0;
+    long port = 0;
+    bool udp = strncmp(host_port, "udp:", 4) == 0;
+    bool valid = fields <= 2 && weight > 0 && weight <= UINT32_MAX;
+    if (udp)
+      host += 4;
+    if (!udp && strncmp(host_port, "unix:", 5) == 0) {
+      host += 5;
+      host_len = strlen(host);
+      valid = valid && host_len > 0 &&
+              host_len < sizeof(((struct sockaddr_un *)0)->sun_path);
+    } else {
+      char *colon = strrchr(host, ':');
+      char *end = NULL;
+      if (colon != NULL) {
+        host_len = (size_t)(colon - host);
+        port = strtol(colon + 1, &end, 10);
+      }
+      valid = valid && colon != NULL && host_len > 0 &&
+              host_len < sizeof(servers->ip) && *end == '\0' && port > 0 &&
+              port <= 65535;
+    }
+    if (!valid) {
+      fprintf(stderr,
+              "%s:%d: expected host:port, udp:host:port or unix:/path "
+              "[weight]\n",
+              path, line_no);
+      ok = false;
+    } else if (n == max_servers) {
+      fprintf(stderr, "At most %d servers are supported\n", max_servers);
+      ok = false;
+    } else {
+      memcpy(servers[n].ip, host, host_len);
+      servers[n].ip[host_len] = '\0';
+      servers[n].port = (int)port;
+      servers[n].udp = udp;
+      servers[n].weight = (uint32_t)weight;
+      n++;
+    }
+  }
+  fclose(file);
+
+  if (ok && n == 0)
+    fprintf(stderr, "No servers in %s\n", path);
+  return ok ? n : 0;
+}
+
+void FormatServer(const struct Server *server, char *buf, size_t size) {
+  if (server->port == 0)
+    snprintf(buf, size, "unix:%s", server->ip);
+  else if (server->udp)
+    snprintf(buf, size, "udp:%s:%d", server->ip, server->port);
+  else
+    snprintf(buf, size, "%s:%d", server->ip, server->port);
+}
+
+static uint64_t AddModulo(uint64_t a, uint64_t b, uint64_t mod) {
+  return a >= mod - b ? a - (mod - b) : a + b;
+}
+
+void CrtCombine(const uint64_t *residues, const uint64_t *factors, int n,
+                struct BigNum *out) {
+  // x = v[0] + v[1] m0 + v[2] m0 m1 + ..., each v[i] < factors[i].
+  uint64_t v[n];
+  for (int i = 0; i < n; i++) {
+    uint64_t m = factors[i];
+    uint64_t acc = 0, radix = 1 % m;
+    for (int j = 0; j < i; j++) {
+      acc = AddModulo(acc, MultModulo(v[j], radix, m), m);
+      radix = MultModulo(radix, factors[j] % m, m);
+    }
+    uint64_t diff = AddModulo(residues[i] % m, (m - acc) % m, m);
+    v[i] = MultModulo(diff, InvMod(radix, m), m);
+  }
+
+  struct BigNum factor, term;
+  BigInit(&factor);
+  BigInit(&term);
+  BigSetU64(out, v[n - 1], BIG_BASE_BIN);
+  for (int i = n - 2; i >= 0; i--) {
+    BigSetU64(&factor, factors[i], BIG_BASE_BIN);
+    BigMul(&term, out, &factor, BIG_BASE_BIN);
+    BigSetU64(out, v[i], BIG_BASE_BIN);
+    BigAdd(out, &term, BIG_BASE_BIN);
+  }
+  BigFree(&term);
+  BigFree(&factor);
+}
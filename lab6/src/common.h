@@ -0,0 +1,61 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bignum.h"
+
+#define MAX_MOD_FACTORS 16
+#define MAX_SERVERS 1024
+
+struct Server {
+  char ip[255]; // host, or the socket path when port is 0
+  int port;     // 0 for a Unix domain socket
+  bool udp;     // one datagram per request instead of a stream
+  uint32_t weight; // share of the range relative to the other servers
+};
+
+struct FactorialArgs {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t mod;
+};
+
+// Elements [begin, end) of the array lab4's GenerateArray fills for seed.
+struct ArraySlice {
+  uint64_t begin;
+  uint64_t end;
+  uint32_t seed;
+};
+
+struct ArrayStats {
+  uint64_t count;
+  int min; // meaningless while count is 0
+  int max;
+  unsigned __int128 sum;
+};
+
+uint64_t MultModulo(uint64_t a, uint64_t b, uint64_t mod);
+bool ConvertStringToUI64(const char *str, uint64_t *val);
+
+// Reads "host:port [weight]" or "unix:/path [weight]" lines; blank lines
+// and '#' comments are skipped and a missing weight means 1. Returns the number of servers, or 0
+// with a message on stderr.
+int LoadServers(const char *path, struct Server *servers, int max_servers);
+
+// "host:port", "udp:host:port" or "unix:/path", as written in a servers
+// file.
+void FormatServer(const struct Server *server, char *buf, size_t size);
+
+// Parses "m1*m2*...*mn" into pairwise coprime factors, each at least 2.
+// Returns the number of factors, or 0 with a message on stderr.
+int ParseModFactors(const char *str, uint64_t *factors, int max_factors);
+
+// The unique x < m1 * ... * mn with x = residues[i] mod factors[i], built
+// with Garner's mixed-radix form so every step stays in word arithmetic.
+void CrtCombine(const uint64_t *residues, const uint64_t *factors, int n,
+                struct BigNum *out);
+
+#endif
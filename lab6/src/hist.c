@@ -0,0 +1,74 @@
+#include "hist.h"
+
+#include <string.h>
+
+static int BucketOf(uint64_t value) {
+  if (value < (1u << HIST_SUB_BITS))
+    return (int)value;
+  int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+  return (shift << HIST_SUB_BITS) + (int)(value >> shift);
+}
+
+static uint64_t BucketTop(int bucket) {
+  if (bucket < (1 << HIST_SUB_BITS))
+    return (uint64_t)bucket;
+  int shift = (bucket >> HIST_SUB_BITS) - 1;
+  uint64_t top = (uint64_t)((bucket & ((1 << HIST_SUB_BITS) - 1)) |
+                            (1 << HIST_SUB_BITS));
+  return ((top + 1) << shift) - 1;
+}
+
+static void Bump(uint64_t *slot, uint64_t by) {
+  __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + by,
+                   __ATOMIC_RELAXED);
+}
+
+void HistRecord(struct Histogram *h, uint64_t value) {
+  Bump(&h->counts[BucketOf(value)], 1);
+  Bump(&h->total, 1);
+  Bump(&h->sum, value);
+  if (value > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+    __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+void HistMerge(struct Histogram *dst, const struct Histogram *src) {
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+  dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+  dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+  if (max > dst->max)
+    dst->max = max;
+}
+
+uint64_t HistPercentile(const struct Histogram *h, double p) {
+  uint64_t total = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    total += h->counts[i];
+  if (total == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(p / 100 * total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank)
+      return BucketTop(i) < h->max ? BucketTop(i) : h->max;
+  }
+  return h->max;
+}
+
+void HistPrint(const struct Histogram *h, const char *name, const char *unit,
+               FILE *out) {
+  fprintf(out,
+          "%s count=%llu mean=%.1f%s p50=%llu%s p90=%llu%s p99=%llu%s "
+          "p999=%llu%s max=%llu%s\n",
+          name, (unsigned long long)h->total,
+          h->total ? (double)h->sum / h->total : 0.0, unit,
+          (unsigned long long)HistPercentile(h, 50), unit,
+          (unsigned long long)HistPercentile(h, 90), unit,
+          (unsigned long long)HistPercentile(h, 99), unit,
+          (unsigned long long)HistPercentile(h, 99.9), unit,
+          (unsigned long long)h->max, unit);
+}
@@ -0,0 +1,31 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Log-linear buckets in the style of HdrHistogram: values below 2^5 are
+// exact, above that every power of two is split into 32 buckets, so any
+// recorded value is known to within about 3%.
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) << HIST_SUB_BITS)
+
+// One writer at a time; readers on other threads see relaxed but
+// untorn counts, so a per-thread histogram needs no lock.
+struct Histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+};
+
+void HistRecord(struct Histogram *h, uint64_t value);
+// dst += src; src may be concurrently written by its owner.
+void HistMerge(struct Histogram *dst, const struct Histogram *src);
+// Upper bound of the bucket holding the p-th percentile (0..100).
+uint64_t HistPercentile(const struct Histogram *h, double p);
+// "name count=... mean=... p50=... p99=... p999=... max=..." in unit.
+void HistPrint(const struct Histogram *h, const char *name, const char *unit,
+               FILE *out);
+
+#endif
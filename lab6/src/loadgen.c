@@ -0,0 +1,560 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "cluster.h"
+#include "common.h"
+#include "hist.h"
+#include "protocol.h"
+
+// Launches a throwaway cluster of lab6 servers on loopback and drives it
+// open-loop: queries arrive on a schedule that does not wait for answers,
+// and latency is counted from the scheduled arrival, so time spent queued
+// behind --concurrency shows up instead of being hidden.
+
+enum KDist { K_FIXED, K_UNIFORM, K_LOGUNIFORM };
+
+struct LoadOptions {
+  int nservers;
+  bool unix_sockets; // launch servers on Unix sockets instead of ports
+  bool udp;          // send requests to the servers' UDP ports
+  int base_port;
+  int tnum;
+  const char *server_path;
+  const char *servers_path;
+  double rate;
+  double duration;
+  int concurrency;
+  bool poisson;
+  enum KDist kdist;
+  uint64_t kmin, kmax;
+  uint64_t seed;
+};
+
+struct Load {
+  struct LoadOptions opts;
+  uint64_t rng;
+  int outstanding;
+  uint64_t completed, failed;
+  uint64_t last_done_ns;
+  struct Histogram latency; // scheduled arrival to answer
+  struct Histogram service; // submit to answer
+};
+
+struct Sent {
+  struct Load *load;
+  uint64_t due_ns, sent_ns;
+};
+
+static volatile sig_atomic_t stop;
+
+static void OnSignal(int sig) { stop = 1; }
+
+static uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t NextRandom(uint64_t *state) {
+  // splitmix64
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static double NextUnit(uint64_t *state) {
+  return (NextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t NextK(struct Load *load) {
+  const struct LoadOptions *o = &load->opts;
+  switch (o->kdist) {
+  case K_UNIFORM:
+    return o->kmin + NextRandom(&load->rng) % (o->kmax - o->kmin + 1);
+  case K_LOGUNIFORM: {
+    double lo = log((double)o->kmin), hi = log((double)o->kmax + 1);
+    uint64_t k = (uint64_t)exp(lo + (hi - lo) * NextUnit(&load->rng));
+    return k < o->kmin ? o->kmin : k > o->kmax ? o->kmax : k;
+  }
+  default:
+    return o->kmin;
+  }
+}
+
+static uint64_t NextGapNs(struct Load *load) {
+  double mean = 1e9 / load->opts.rate;
+  if (!load->opts.poisson)
+    return (uint64_t)mean;
+  return (uint64_t)(-log(1.0 - NextUnit(&load->rng)) * mean);
+}
+
+static bool ParseKDist(const char *str, struct LoadOptions *o) {
+  unsigned long long a, b;
+  char extra;
+  if (sscanf(str, "fixed:%llu %c", &a, &extra) == 1) {
+    o->kdist = K_FIXED;
+    b = a;
+  } else if (sscanf(str, "uniform:%llu:%llu %c", &a, &b, &extra) == 2) {
+    o->kdist = K_UNIFORM;
+  } else if (sscanf(str, "loguniform:%llu:%llu %c", &a, &b, &extra) == 2) {
+    o->kdist = K_LOGUNIFORM;
+  } else {
+    return false;
+  }
+  if (a < 1 || b < a)
+    return false;
+  o->kmin = a;
+  o->kmax = b;
+  return true;
+}
+
+static void OnAnswer(void *arg, uint64_t query, bool ok,
+                     const uint64_t *residues, int nfactors) {
+  struct Sent *sent = arg;
+  struct Load *load = sent->load;
+  uint64_t now = NowNs();
+  load->outstanding--;
+  load->last_done_ns = now;
+  if (ok) {
+    load->completed++;
+    HistRecord(&load->latency, (now - sent->due_ns) / 1000);
+    HistRecord(&load->service, (now - sent->sent_ns) / 1000);
+  } else {
+    load->failed++;
+  }
+  free(sent);
+}
+
+// A server is up once it answers where the cluster will reach it: a stream
+// connect, or over UDP the reply to a one-term request.
+static bool ProbeServer(const struct Server *server) {
+  struct sockaddr_storage addr;
+  socklen_t len;
+  memset(&addr, 0, sizeof(addr));
+  if (server->port == 0) {
+    struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+    un->sun_family = AF_UNIX;
+    strncpy(un->sun_path, server->ip, sizeof(un->sun_path) - 1);
+    len = sizeof(*un);
+  } else {
+    struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(server->port);
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(*in);
+  }
+
+  int fd = socket(addr.ss_family, server->udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  bool up = connect(fd, (struct sockaddr *)&addr, len) == 0;
+  if (up && server->udp) {
+    char frame[FRAME_HEADER_SIZE + 2 * sizeof(uint32_t) + RANGE_WIRE_SIZE];
+    struct FactorialArgs one = {1, 1, 2};
+    size_t n = EncodeRanges(frame, 0, &one, 1, 0);
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    up = send(fd, frame, n, 0) == (ssize_t)n && poll(&pfd, 1, 10) == 1 &&
+         recv(fd, frame, sizeof(frame), 0) > 0;
+  }
+  close(fd);
+  return up;
+}
+
+// Waits for the server started as *pid to come up. A server that exits
+// first, say because its port is taken, is reaped and *pid cleared.
+static bool WaitForServer(const struct Server *server, pid_t *pid,
+                          double timeout_ms) {
+  uint64_t deadline = NowNs() + (uint64_t)(timeout_ms * 1e6);
+  while (NowNs() < deadline) {
+    if (waitpid(*pid, NULL, WNOHANG) == *pid) {
+      *pid = 0;
+      return false;
+    }
+    if (ProbeServer(server))
+      return true;
+    usleep(10000);
+  }
+  return false;
+}
+
+static void StopServers(pid_t *pids, int n) {
+  for (int i = 0; i < n; i++)
+    if (pids[i] > 0)
+      kill(pids[i], SIGTERM);
+  for (int i = 0; i < n; i++)
+    if (pids[i] > 0)
+      waitpid(pids[i], NULL, 0);
+}
+
+// Starts the servers and writes their addresses to servers_path. Returns
+// the number started; on failure the ones already running are stopped.
+static int StartServers(const struct LoadOptions *o, pid_t *pids,
+                        struct Server *servers) {
+  char tnum[16];
+  snprintf(tnum, sizeof(tnum), "%d", o->tnum);
+  for (int i = 0; i < o->nservers; i++) {
+    if (o->unix_sockets) {
+      snprintf(servers[i].ip, sizeof(servers[i].ip), "/tmp/loadgen-%d-%d.sock",
+               (int)getpid(), i);
+      servers[i].port = 0;
+    } else {
+      strcpy(servers[i].ip, "127.0.0.1");
+      servers[i].port = o->base_port + i;
+    }
+    servers[i].weight = 1;
+    servers[i].udp = o->udp;
+
+    // Something already answering there would pass for our server.
+    if (ProbeServer(&servers[i])) {
+      char name[sizeof(servers[i].ip) + 16];
+      FormatServer(&servers[i], name, sizeof(name));
+      fprintf(stderr, "Something is already listening on %s\n", name);
+      StopServers(pids, i);
+      return 0;
+    }
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", servers[i].port);
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      fprintf(stderr, "fork failed!\n");
+      StopServers(pids, i);
+      return 0;
+    }
+    if (pids[i] == 0) {
+      // Keep the servers' startup lines out of the report.
+      int null_fd = open("/dev/null", O_WRONLY);
+      if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+      }
+      if (o->unix_sockets)
+        execl(o->server_path, o->server_path, "--unix", servers[i].ip,
+              "--tnum", tnum, (char *)NULL);
+      else if (o->udp)
+        execl(o->server_path, o->server_path, "--port", port, "--udp",
+              "--tnum", tnum, (char *)NULL);
+      else
+        execl(o->server_path, o->server_path, "--port", port, "--tnum", tnum,
+              (char *)NULL);
+      fprintf(stderr, "Can not run %s: %s\n", o->server_path,
+              strerror(errno));
+      _exit(127);
+    }
+  }
+
+  for (int i = 0; i < o->nservers; i++) {
+    if (!WaitForServer(&servers[i], &pids[i], 5000)) {
+      char name[sizeof(servers[i].ip) + 16];
+      FormatServer(&servers[i], name, sizeof(name));
+      fprintf(stderr, "Server %s %s\n", name,
+              pids[i] == 0 ? "exited on startup" : "did not come up");
+      StopServers(pids, o->nservers);
+      return 0;
+    }
+  }
+
+  FILE *file = fopen(o->servers_path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Can not write servers file %s\n", o->servers_path);
+    StopServers(pids, o->nservers);
+    return 0;
+  }
+  for (int i = 0; i < o->nservers; i++) {
+    char name[sizeof(servers[i].ip) + 16];
+    FormatServer(&servers[i], name, sizeof(name));
+    fprintf(file, "%s\n", name);
+  }
+  fclose(file);
+  return o->nservers;
+}
+
+static void Run(struct Load *load, struct Cluster *cluster, uint64_t mod) {
+  const struct LoadOptions *o = &load->opts;
+  uint64_t start = NowNs();
+  uint64_t end = start + (uint64_t)(o->duration * 1e9);
+  uint64_t due = start;
+  uint64_t offered = 0;
+
+  while (!stop && (due < end || load->outstanding > 0)) {
+    uint64_t now = NowNs();
+    // Arrivals that found every slot taken stay due and keep their
+    // original time, so the wait is charged to their latency.
+    while (due < end && due <= now && load->outstanding < o->concurrency) {
+      struct Sent *sent = malloc(sizeof(struct Sent));
+      sent->load = load;
+      sent->due_ns = due;
+      sent->sent_ns = now;
+      load->outstanding++;
+      offered++;
+      ClusterSubmit(cluster, 1, NextK(load), &mod, 1, OnAnswer, sent);
+      due += NextGapNs(load);
+    }
+
+    int timeout_ms = -1;
+    if (due < end && load->outstanding < o->concurrency)
+      timeout_ms = due <= now ? 0 : (int)((due - now) / 1000000);
+    ClusterPoll(cluster, timeout_ms);
+  }
+
+  uint64_t elapsed = (load->last_done_ns > start ? load->last_done_ns : NowNs()) -
+                     start;
+  double seconds = elapsed / 1e9;
+  printf("servers=%d offered=%.0f/s sent=%llu completed=%llu failed=%llu "
+         "in %.2fs: %.0f queries/s\n",
+         cluster->nservers, o->rate, (unsigned long long)offered,
+         (unsigned long long)load->completed,
+         (unsigned long long)load->failed, seconds,
+         seconds > 0 ? load->completed / seconds : 0.0);
+  HistPrint(&load->latency, "latency", "us", stdout);
+  HistPrint(&load->service, "service", "us", stdout);
+}
+
+int main(int argc, char **argv) {
+  struct LoadOptions o = {
+      .nservers = 2,
+      .base_port = 21000,
+      .tnum = 1,
+      .server_path = "./server",
+      .servers_path = NULL,
+      .rate = 1000,
+      .duration = 5,
+      .concurrency = 64,
+      .poisson = true,
+      .kdist = K_FIXED,
+      .kmin = 1000,
+      .kmax = 1000,
+      .seed = 1,
+  };
+  uint64_t mod = 1000000007;
+  struct ClusterOptions cluster_opts = CLUSTER_DEFAULT_OPTIONS;
+
+  while (true) {
+    static struct option options[] = {{"nservers", required_argument, 0, 0},
+                                      {"base-port", required_argument, 0, 0},
+                                      {"tnum", required_argument, 0, 0},
+                                      {"server", required_argument, 0, 0},
+                                      {"servers", required_argument, 0, 0},
+                                      {"rate", required_argument, 0, 0},
+                                      {"duration", required_argument, 0, 0},
+                                      {"concurrency", required_argument, 0, 0},
+                                      {"arrival", required_argument, 0, 0},
+                                      {"k", required_argument, 0, 0},
+                                      {"mod", required_argument, 0, 0},
+                                      {"sched", required_argument, 0, 0},
+                                      {"conns", required_argument, 0, 0},
+                                      {"seed", required_argument, 0, 0},
+                                      {"transport", required_argument, 0, 0},
+                                      {"timeout", required_argument, 0, 0},
+                                      {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0: {
+      switch (option_index) {
+      case 0:
+        o.nservers = atoi(optarg);
+        if (o.nservers < 0 || o.nservers > MAX_SERVERS) {
+          fprintf(stderr, "nservers must be in 0..%d\n", MAX_SERVERS);
+          return 1;
+        }
+        break;
+      case 1:
+        o.base_port = atoi(optarg);
+        if (o.base_port <= 0 || o.base_port > 65535) {
+          fprintf(stderr, "base-port must be in 1..65535\n");
+          return 1;
+        }
+        break;
+      case 2:
+        o.tnum = atoi(optarg);
+        if (o.tnum <= 0) {
+          fprintf(stderr, "tnum must be a positive number\n");
+          return 1;
+        }
+        break;
+      case 3:
+        o.server_path = optarg;
+        break;
+      case 4:
+        o.servers_path = optarg;
+        break;
+      case 5:
+        o.rate = atof(optarg);
+        if (o.rate <= 0) {
+          fprintf(stderr, "rate must be a positive number of queries/s\n");
+          return 1;
+        }
+        break;
+      case 6:
+        o.duration = atof(optarg);
+        if (o.duration <= 0) {
+          fprintf(stderr, "duration must be a positive number of seconds\n");
+          return 1;
+        }
+        break;
+      case 7:
+        o.concurrency = atoi(optarg);
+        if (o.concurrency <= 0) {
+          fprintf(stderr, "concurrency must be a positive number\n");
+          return 1;
+        }
+        break;
+      case 8:
+        if (strcmp(optarg, "poisson") == 0) {
+          o.poisson = true;
+        } else if (strcmp(optarg, "fixed") == 0) {
+          o.poisson = false;
+        } else {
+          fprintf(stderr, "arrival must be poisson or fixed\n");
+          return 1;
+        }
+        break;
+      case 9:
+        if (!ParseKDist(optarg, &o)) {
+          fprintf(stderr, "k must be fixed:N, uniform:A:B or "
+                          "loguniform:A:B with 1 <= A <= B\n");
+          return 1;
+        }
+        break;
+      case 10:
+        if (!ConvertStringToUI64(optarg, &mod) || mod < 2) {
+          fprintf(stderr, "mod must be a number above 1\n");
+          return 1;
+        }
+        break;
+      case 11:
+        if (strcmp(optarg, "static") == 0) {
+          cluster_opts.sched = CLUSTER_STATIC;
+        } else if (strcmp(optarg, "dynamic") == 0) {
+          cluster_opts.sched = CLUSTER_DYNAMIC;
+        } else {
+          fprintf(stderr, "sched must be static or dynamic\n");
+          return 1;
+        }
+        break;
+      case 12:
+        cluster_opts.conns_per_server = atoi(optarg);
+        if (cluster_opts.conns_per_server <= 0) {
+          fprintf(stderr, "conns must be a positive number\n");
+          return 1;
+        }
+        break;
+      case 13:
+        ConvertStringToUI64(optarg, &o.seed);
+        break;
+      case 14:
+        o.unix_sockets = strcmp(optarg, "unix") == 0;
+        o.udp = strcmp(optarg, "udp") == 0;
+        if (!o.unix_sockets && !o.udp && strcmp(optarg, "tcp") != 0) {
+          fprintf(stderr, "transport must be tcp, udp or unix\n");
+          return 1;
+        }
+        break;
+      case 15:
+        cluster_opts.timeout_ms = atof(optarg);
+        if (cluster_opts.timeout_ms < 0) {
+          fprintf(stderr, "timeout must be a number of milliseconds\n");
+          return 1;
+        }
+        break;
+      default:
+        printf("Index %d is out of options\n", option_index);
+      }
+    } break;
+
+    case '?':
+      fprintf(stderr,
+              "Using: %s [--nservers 2] [--base-port 21000] [--tnum 1] "
+              "[--server ./server] [--servers file]\n"
+              "       [--transport tcp|udp|unix]\n"
+              "       [--rate 1000] [--duration 5] [--concurrency 64] "
+              "[--arrival poisson|fixed]\n"
+              "       [--k fixed:N|uniform:A:B|loguniform:A:B] [--mod m] "
+              "[--sched static|dynamic] [--conns 1] [--seed 1]\n"
+              "       [--timeout ms]\n"
+              "       --nservers 0 drives the servers already listed in "
+              "--servers instead of starting new ones, following edits "
+              "to that file\n",
+              argv[0]);
+      return 1;
+    default:
+      fprintf(stderr, "getopt returned character code 0%o?\n", c);
+    }
+  }
+
+  char default_path[64];
+  if (o.servers_path == NULL) {
+    if (o.nservers == 0) {
+      fprintf(stderr, "--nservers 0 needs a --servers file\n");
+      return 1;
+    }
+    snprintf(default_path, sizeof(default_path), "/tmp/loadgen-%d.servers",
+             (int)getpid());
+    o.servers_path = default_path;
+  }
+
+  struct Server *servers = malloc(sizeof(struct Server) * MAX_SERVERS);
+  pid_t *pids = calloc(MAX_SERVERS, sizeof(pid_t));
+  int nservers = o.nservers > 0 ? StartServers(&o, pids, servers)
+                                : LoadServers(o.servers_path, servers,
+                                              MAX_SERVERS);
+  if (nservers == 0)
+    return 1;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = OnSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  static struct Load load;
+  load.opts = o;
+  load.rng = o.seed;
+
+  int rc = 1;
+  struct Cluster cluster;
+  if (ClusterInit(&cluster, servers, nservers, &cluster_opts)) {
+    if (o.nservers == 0)
+      ClusterWatchServers(&cluster, o.servers_path);
+    Run(&load, &cluster, mod);
+    ClusterPrintStats(&cluster, stderr);
+    ClusterDestroy(&cluster);
+    rc = stop ? 1 : 0;
+  }
+
+  if (o.nservers > 0) {
+    StopServers(pids, o.nservers);
+    // An epoll server dies on SIGTERM without removing its socket file.
+    for (int i = 0; i < o.nservers && o.unix_sockets; i++)
+      unlink(servers[i].ip);
+    if (o.servers_path == default_path)
+      unlink(default_path);
+  }
+  free(pids);
+  free(servers);
+  return rc;
+}
@@ -0,0 +1,108 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Enough for the event loop and both worker pools at any sane --tnum.
+// Threads past the limit share the last shard, which only costs accuracy.
+#define MAX_SHARDS 256
+
+struct MetricShard {
+  uint64_t counters[METRIC_COUNT];
+  struct Histogram hists[HIST_COUNT];
+};
+
+static const char *counter_names[METRIC_COUNT] = {
+    "connections_total", "connections_closed_total", "requests_total",
+    "ranges_total",      "errors_total",             "cancelled_total",
+    "rejected_total",    "bytes_in_total",           "bytes_out_total",
+};
+
+static const char *hist_names[HIST_COUNT] = {
+    "queue_wait_us",
+    "compute_us",
+    "latency_us",
+};
+
+static struct MetricShard *shards[MAX_SHARDS];
+static int nshards;
+static __thread struct MetricShard *mine;
+
+static struct MetricShard *Shard(void) {
+  if (mine != NULL)
+    return mine;
+  int index = __atomic_fetch_add(&nshards, 1, __ATOMIC_RELAXED);
+  if (index >= MAX_SHARDS) {
+    while (__atomic_load_n(&shards[MAX_SHARDS - 1], __ATOMIC_ACQUIRE) == NULL)
+      ;
+    mine = shards[MAX_SHARDS - 1];
+    return mine;
+  }
+  struct MetricShard *shard = calloc(1, sizeof(*shard));
+  if (shard == NULL)
+    abort();
+  __atomic_store_n(&shards[index], shard, __ATOMIC_RELEASE);
+  mine = shard;
+  return mine;
+}
+
+void MetricAdd(enum Metric metric, uint64_t by) {
+  uint64_t *slot = &Shard()->counters[metric];
+  __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + by,
+                   __ATOMIC_RELAXED);
+}
+
+void MetricRecord(enum MetricHist hist, uint64_t value_us) {
+  HistRecord(&Shard()->hists[hist], value_us);
+}
+
+uint64_t MetricsNowUs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+size_t MetricsRender(char *buf, size_t size) {
+  uint64_t counters[METRIC_COUNT] = {0};
+  static struct Histogram hists[HIST_COUNT];
+  for (int h = 0; h < HIST_COUNT; h++)
+    hists[h] = (struct Histogram){{0}};
+
+  int n = __atomic_load_n(&nshards, __ATOMIC_RELAXED);
+  if (n > MAX_SHARDS)
+    n = MAX_SHARDS;
+  for (int s = 0; s < n; s++) {
+    const struct MetricShard *shard =
+        __atomic_load_n(&shards[s], __ATOMIC_ACQUIRE);
+    if (shard == NULL)
+      continue;
+    for (int m = 0; m < METRIC_COUNT; m++)
+      counters[m] += __atomic_load_n(&shard->counters[m], __ATOMIC_RELAXED);
+    for (int h = 0; h < HIST_COUNT; h++)
+      HistMerge(&hists[h], &shard->hists[h]);
+  }
+
+  static const double quantiles[] = {50, 90, 99, 99.9};
+  size_t len = 0;
+#define EMIT(...)                                                              \
+  do {                                                                         \
+    if (len < size)                                                            \
+      len += (size_t)snprintf(buf + len, size - len, __VA_ARGS__);             \
+  } while (0)
+  for (int m = 0; m < METRIC_COUNT; m++)
+    EMIT("%s %llu\n", counter_names[m], (unsigned long long)counters[m]);
+  EMIT("connections_open %llu\n",
+       (unsigned long long)(counters[METRIC_CONNECTIONS] -
+                            counters[METRIC_CLOSED]));
+  for (int h = 0; h < HIST_COUNT; h++) {
+    for (int q = 0; q < 4; q++)
+      EMIT("%s{quantile=\"%g\"} %llu\n", hist_names[h], quantiles[q] / 100,
+           (unsigned long long)HistPercentile(&hists[h], quantiles[q]));
+    EMIT("%s_max %llu\n", hist_names[h], (unsigned long long)hists[h].max);
+    EMIT("%s_sum %llu\n", hist_names[h], (unsigned long long)hists[h].sum);
+    EMIT("%s_count %llu\n", hist_names[h], (unsigned long long)hists[h].total);
+  }
+#undef EMIT
+  return len < size ? len : size;
+}
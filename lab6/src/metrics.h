@@ -0,0 +1,41 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hist.h"
+
+enum Metric {
+  METRIC_CONNECTIONS, // accepted
+  METRIC_CLOSED,
+  METRIC_REQUESTS, // frames dispatched to the workers
+  METRIC_RANGES,
+  METRIC_ERRORS, // error replies and dropped streams
+  METRIC_CANCELLED, // stopped by their deadline or a closed connection
+  METRIC_REJECTED,  // turned away busy by --max-queue
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_COUNT,
+};
+
+enum MetricHist {
+  HIST_QUEUE_WAIT, // dispatch to a worker picking the request up
+  HIST_COMPUTE,    // worker time per request
+  HIST_LATENCY,    // dispatch to reply queued
+  HIST_COUNT,
+};
+
+// Counters and histograms are kept per thread: each thread only ever
+// writes its own shard, so recording is a plain relaxed store with no
+// lock and no shared cache line. Readers sum the shards.
+void MetricAdd(enum Metric metric, uint64_t by);
+void MetricRecord(enum MetricHist hist, uint64_t value_us);
+
+uint64_t MetricsNowUs(void);
+
+// Renders every counter and histogram as "name value" lines into buf.
+// Returns the length written, truncated to size.
+size_t MetricsRender(char *buf, size_t size);
+
+#endif
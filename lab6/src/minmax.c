@@ -0,0 +1,163 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <sys/time.h>
+
+#include "cluster.h"
+#include "common.h"
+
+struct Answer {
+  bool done;
+  bool ok;
+  struct ArrayStats stats;
+};
+
+static void OnAnswer(void *arg, uint64_t query, bool ok,
+                     const struct ArrayStats *stats) {
+  struct Answer *answer = arg;
+  answer->done = true;
+  answer->ok = ok;
+  answer->stats = *stats;
+}
+
+static void FormatU128(unsigned __int128 value, char *buf) {
+  char digits[40];
+  int n = 0;
+  do {
+    digits[n++] = (char)('0' + (int)(value % 10));
+    value /= 10;
+  } while (value > 0);
+  while (n > 0)
+    *buf++ = digits[--n];
+  *buf = '\0';
+}
+
+int main(int argc, char **argv) {
+  uint64_t seed = -1;
+  uint64_t array_size = 0;
+  const char *servers_path = NULL;
+  struct ClusterOptions opts = CLUSTER_DEFAULT_OPTIONS;
+
+  while (true) {
+    static struct option options[] = {{"seed", required_argument, 0, 0},
+                                      {"array_size", required_argument, 0, 0},
+                                      {"servers", required_argument, 0, 0},
+                                      {"sched", required_argument, 0, 0},
+                                      {"timeout", required_argument, 0, 0},
+                                      {"conns", required_argument, 0, 0},
+                                      {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0: {
+      switch (option_index) {
+      case 0:
+        if (!ConvertStringToUI64(optarg, &seed) || seed > UINT32_MAX) {
+          fprintf(stderr, "seed must be an unsigned int\n");
+          return 1;
+        }
+        break;
+      case 1:
+        if (!ConvertStringToUI64(optarg, &array_size) || array_size == 0) {
+          fprintf(stderr, "array_size must be a positive number\n");
+          return 1;
+        }
+        break;
+      case 2:
+        servers_path = optarg;
+        break;
+      case 3:
+        if (strcmp(optarg, "static") == 0) {
+          opts.sched = CLUSTER_STATIC;
+        } else if (strcmp(optarg, "dynamic") == 0) {
+          opts.sched = CLUSTER_DYNAMIC;
+        } else {
+          fprintf(stderr, "sched must be static or dynamic\n");
+          return 1;
+        }
+        break;
+      case 4:
+        opts.timeout_ms = atof(optarg);
+        if (opts.timeout_ms < 0) {
+          fprintf(stderr, "timeout must be a number of milliseconds\n");
+          return 1;
+        }
+        break;
+      case 5:
+        opts.conns_per_server = atoi(optarg);
+        if (opts.conns_per_server <= 0) {
+          fprintf(stderr, "conns must be a positive number\n");
+          return 1;
+        }
+        break;
+      default:
+        printf("Index %d is out of options\n", option_index);
+      }
+    } break;
+
+    case '?':
+      printf("Arguments error\n");
+      break;
+    default:
+      fprintf(stderr, "getopt returned character code 0%o?\n", c);
+    }
+  }
+
+  if (seed == (uint64_t)-1 || array_size == 0 || servers_path == NULL) {
+    fprintf(stderr,
+            "Using: %s --seed 42 --array_size 1000000000 --servers "
+            "/path/to/file\n",
+            argv[0]);
+    fprintf(stderr, "       finds min, max and sum of lab4's "
+                    "GenerateArray(seed) on the servers\n");
+    fprintf(stderr, "       --sched, --timeout and --conns work as for "
+                    "client\n");
+    return 1;
+  }
+
+  struct Server *to = malloc(sizeof(struct Server) * MAX_SERVERS);
+  int servers_num = LoadServers(servers_path, to, MAX_SERVERS);
+  if (servers_num == 0)
+    return 1;
+
+  struct Cluster cluster;
+  if (!ClusterInit(&cluster, to, servers_num, &opts))
+    return 1;
+  ClusterWatchServers(&cluster, servers_path);
+
+  struct timeval start, finish;
+  gettimeofday(&start, NULL);
+  struct Answer answer = {false};
+  ClusterSubmitReduce(&cluster, (uint32_t)seed, 0, array_size, OnAnswer,
+                      &answer);
+  while (!answer.done)
+    ClusterPoll(&cluster, -1);
+  gettimeofday(&finish, NULL);
+  ClusterPrintStats(&cluster, stderr);
+  ClusterDestroy(&cluster);
+  free(to);
+  if (!answer.ok) {
+    fprintf(stderr, "All servers failed\n");
+    return 1;
+  }
+
+  double elapsed_ms = (finish.tv_sec - start.tv_sec) * 1000.0 +
+                      (finish.tv_usec - start.tv_usec) / 1000.0;
+  char sum[40];
+  FormatU128(answer.stats.sum, sum);
+  printf("Min: %d\n", answer.stats.min);
+  printf("Max: %d\n", answer.stats.max);
+  printf("Sum: %s\n", sum);
+  printf("Elapsed time: %.3fms, %.0f elements/ms\n", elapsed_ms,
+         array_size / elapsed_ms);
+  return 0;
+}
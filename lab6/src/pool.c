@@ -0,0 +1,110 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// The lane a worker should take from next, or -1 if none may run now.
+static int PickLane(const struct ThreadPool *pool) {
+  int first = -1, aged = -1;
+  uint64_t now = pool->max_wait_ns > 0 ? NowNs() : 0;
+  for (int lane = 0; lane < POOL_LANES; lane++) {
+    const struct PoolTask *task = pool->head[lane];
+    if (task == NULL || pool->running[lane] >= pool->max_running[lane])
+      continue;
+    if (first < 0)
+      first = lane;
+    if (pool->max_wait_ns > 0 &&
+        now - task->submitted_ns >= pool->max_wait_ns &&
+        (aged < 0 ||
+         task->submitted_ns < pool->head[aged]->submitted_ns))
+      aged = lane;
+  }
+  return aged >= 0 ? aged : first;
+}
+
+static void *PoolWorker(void *arg) {
+  struct ThreadPool *pool = arg;
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    int lane;
+    while ((lane = PickLane(pool)) < 0 && !pool->stopping)
+      pthread_cond_wait(&pool->has_work, &pool->lock);
+    if (lane < 0)
+      break;
+    struct PoolTask *task = pool->head[lane];
+    pool->head[lane] = task->next;
+    if (pool->head[lane] == NULL)
+      pool->tail[lane] = NULL;
+    pool->running[lane]++;
+    pthread_mutex_unlock(&pool->lock);
+
+    task->run(task->arg);
+
+    pthread_mutex_lock(&pool->lock);
+    // A lane held back by its limit may go again.
+    if (pool->running[lane]-- == pool->max_running[lane] &&
+        pool->head[lane] != NULL)
+      pthread_cond_signal(&pool->has_work);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+bool PoolInit(struct ThreadPool *pool, int nthreads) {
+  pool->threads = malloc(sizeof(pthread_t) * nthreads);
+  if (pool->threads == NULL)
+    return false;
+  pool->nthreads = 0;
+  for (int lane = 0; lane < POOL_LANES; lane++) {
+    pool->head[lane] = pool->tail[lane] = NULL;
+    pool->running[lane] = 0;
+    pool->max_running[lane] = nthreads;
+  }
+  pool->max_wait_ns = 0;
+  pool->stopping = false;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->has_work, NULL);
+
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, PoolWorker, pool)) {
+      fprintf(stderr, "Error: pthread_create failed!\n");
+      PoolShutdown(pool);
+      return false;
+    }
+    pool->nthreads++;
+  }
+  return true;
+}
+
+void PoolSubmit(struct ThreadPool *pool, struct PoolTask *task,
+                enum PoolLane lane) {
+  task->next = NULL;
+  task->submitted_ns = pool->max_wait_ns > 0 ? NowNs() : 0;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail[lane] != NULL)
+    pool->tail[lane]->next = task;
+  else
+    pool->head[lane] = task;
+  pool->tail[lane] = task;
+  pthread_cond_signal(&pool->has_work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void PoolShutdown(struct ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->has_work);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+  free(pool->threads);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->has_work);
+}
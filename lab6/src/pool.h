@@ -0,0 +1,41 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Queues of one pool, most urgent first.
+enum PoolLane { POOL_LANE_SMALL, POOL_LANE_LARGE, POOL_LANES };
+
+struct PoolTask {
+  void (*run)(void *arg);
+  void *arg;
+  struct PoolTask *next;
+  uint64_t submitted_ns; // set by PoolSubmit
+};
+
+// Fixed set of long-lived workers draining FIFO lanes. A worker takes the
+// head of the first lane with work, unless some head has waited max_wait_ns
+// (then the oldest such head), and never runs more than max_running[lane]
+// tasks of one lane at once.
+struct ThreadPool {
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t has_work;
+  struct PoolTask *head[POOL_LANES];
+  struct PoolTask *tail[POOL_LANES];
+  int running[POOL_LANES];
+  int max_running[POOL_LANES]; // nthreads unless set before the first submit
+  uint64_t max_wait_ns;        // 0 serves the lanes strictly in order
+  bool stopping;
+};
+
+bool PoolInit(struct ThreadPool *pool, int nthreads);
+// The task memory is owned by the caller and must outlive the run.
+void PoolSubmit(struct ThreadPool *pool, struct PoolTask *task,
+                enum PoolLane lane);
+void PoolShutdown(struct ThreadPool *pool);
+
+#endif
@@ -0,0 +1,236 @@
+#include "protocol.h"
+
+#include <stdlib.h>
+
+bool GrowBuffer(char **buf, size_t *cap, size_t need) {
+  if (need <= *cap)
+    return true;
+  size_t new_cap = *cap ? *cap : 4096;
+  while (new_cap < need)
+    new_cap *= 2;
+  char *p = realloc(*buf, new_cap);
+  if (p == NULL)
+    return false;
+  *buf = p;
+  *cap = new_cap;
+  return true;
+}
+
+void PutU32(char *buf, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    buf[i] = (char)(value >> (8 * i));
+}
+
+void PutU64(char *buf, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    buf[i] = (char)(value >> (8 * i));
+}
+
+uint32_t GetU32(const char *buf) {
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; i--)
+    value = value << 8 | (unsigned char)buf[i];
+  return value;
+}
+
+uint64_t GetU64(const char *buf) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--)
+    value = value << 8 | (unsigned char)buf[i];
+  return value;
+}
+
+long FrameLength(const char *buf, size_t avail) {
+  if (avail < FRAME_HEADER_SIZE)
+    return 0;
+  uint32_t length = GetU32(buf);
+  if ((unsigned char)buf[4] != PROTO_VERSION || length < FRAME_HEADER_SIZE ||
+      length > MAX_FRAME_SIZE)
+    return -1;
+  return avail < length ? 0 : (long)length;
+}
+
+void DecodeHeader(const char *buf, struct FrameHeader *header) {
+  header->length = GetU32(buf);
+  header->version = (uint8_t)buf[4];
+  header->type = (uint8_t)buf[5];
+  header->flags = (uint16_t)((unsigned char)buf[6] | (unsigned char)buf[7] << 8);
+  header->id = GetU64(buf + 8);
+}
+
+static void PutHeader(char *buf, uint32_t length, uint8_t type,
+                      uint16_t flags, uint64_t id) {
+  PutU32(buf, length);
+  buf[4] = PROTO_VERSION;
+  buf[5] = (char)type;
+  buf[6] = (char)flags;
+  buf[7] = (char)(flags >> 8);
+  PutU64(buf + 8, id);
+}
+
+size_t FrameSizeFor(uint32_t n) {
+  // Results are smaller than ranges, so a range-sized frame fits either.
+  // The first word is the deadline; the second the count.
+  return FRAME_HEADER_SIZE + 2 * sizeof(uint32_t) + (size_t)n * RANGE_WIRE_SIZE;
+}
+
+size_t EncodeRanges(char *buf, uint64_t id, const struct FactorialArgs *ranges,
+                    uint32_t n, uint32_t deadline_ms) {
+  char *p = buf + FRAME_HEADER_SIZE;
+  if (deadline_ms != 0) {
+    PutU32(p, deadline_ms);
+    p += sizeof(uint32_t);
+  }
+  if (n != 1) {
+    PutU32(p, n);
+    p += sizeof(uint32_t);
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    PutU64(p, ranges[i].begin);
+    PutU64(p + 8, ranges[i].end);
+    PutU64(p + 16, ranges[i].mod);
+    p += RANGE_WIRE_SIZE;
+  }
+  PutHeader(buf, (uint32_t)(p - buf), n == 1 ? FRAME_RANGE : FRAME_BATCH,
+            deadline_ms != 0 ? FRAME_FLAG_DEADLINE : 0, id);
+  return (size_t)(p - buf);
+}
+
+size_t EncodeResults(char *buf, uint64_t id, const uint64_t *results,
+                     uint32_t n) {
+  char *p = buf + FRAME_HEADER_SIZE;
+  PutU32(p, n);
+  p += sizeof(uint32_t);
+  for (uint32_t i = 0; i < n; i++, p += sizeof(uint64_t))
+    PutU64(p, results[i]);
+  PutHeader(buf, (uint32_t)(p - buf), FRAME_RESULT, 0, id);
+  return (size_t)(p - buf);
+}
+
+size_t EncodeReduce(char *buf, uint64_t id, const struct ArraySlice *slice,
+                    uint32_t deadline_ms) {
+  char *p = buf + FRAME_HEADER_SIZE;
+  if (deadline_ms != 0) {
+    PutU32(p, deadline_ms);
+    p += sizeof(uint32_t);
+  }
+  PutU64(p, slice->begin);
+  PutU64(p + 8, slice->end);
+  PutU32(p + 16, slice->seed);
+  p += REDUCE_WIRE_SIZE;
+  PutHeader(buf, (uint32_t)(p - buf), FRAME_REDUCE,
+            deadline_ms != 0 ? FRAME_FLAG_DEADLINE : 0, id);
+  return (size_t)(p - buf);
+}
+
+size_t EncodeStats(char *buf, uint64_t id, const struct ArrayStats *stats) {
+  char *p = buf + FRAME_HEADER_SIZE;
+  PutU64(p, stats->count);
+  PutU32(p + 8, (uint32_t)stats->min);
+  PutU32(p + 12, (uint32_t)stats->max);
+  PutU64(p + 16, (uint64_t)stats->sum);
+  PutU64(p + 24, (uint64_t)(stats->sum >> 64));
+  PutHeader(buf, FRAME_HEADER_SIZE + STATS_WIRE_SIZE, FRAME_STATS, 0, id);
+  return FRAME_HEADER_SIZE + STATS_WIRE_SIZE;
+}
+
+size_t EncodeError(char *buf, uint64_t id, uint32_t code) {
+  PutU32(buf + FRAME_HEADER_SIZE, code);
+  size_t length = FRAME_HEADER_SIZE + sizeof(uint32_t);
+  PutHeader(buf, (uint32_t)length, FRAME_ERROR, 0, id);
+  return length;
+}
+
+size_t EncodeBusy(char *buf, uint64_t id, uint32_t retry_after_ms) {
+  PutU32(buf + FRAME_HEADER_SIZE, PROTO_ERR_BUSY);
+  PutU32(buf + FRAME_HEADER_SIZE + sizeof(uint32_t), retry_after_ms);
+  PutHeader(buf, ERROR_FRAME_SIZE, FRAME_ERROR, 0, id);
+  return ERROR_FRAME_SIZE;
+}
+
+size_t EncodeCancel(char *buf, uint64_t id) {
+  PutHeader(buf, FRAME_HEADER_SIZE, FRAME_CANCEL, 0, id);
+  return FRAME_HEADER_SIZE;
+}
+
+long DecodeRanges(const char *frame, const struct FrameHeader *header,
+                  struct FactorialArgs *ranges, uint32_t max_ranges,
+                  uint32_t *deadline_ms) {
+  const char *p = frame + FRAME_HEADER_SIZE;
+  size_t payload = header->length - FRAME_HEADER_SIZE;
+  *deadline_ms = 0;
+  if (header->flags & FRAME_FLAG_DEADLINE) {
+    if (payload < sizeof(uint32_t))
+      return -1;
+    *deadline_ms = GetU32(p);
+    p += sizeof(uint32_t);
+    payload -= sizeof(uint32_t);
+  }
+  uint32_t n = 1;
+  if (header->type == FRAME_BATCH) {
+    if (payload < sizeof(uint32_t))
+      return -1;
+    n = GetU32(p);
+    p += sizeof(uint32_t);
+    payload -= sizeof(uint32_t);
+  } else if (header->type != FRAME_RANGE) {
+    return -1;
+  }
+  if (n > max_ranges || payload != (size_t)n * RANGE_WIRE_SIZE)
+    return -1;
+
+  for (uint32_t i = 0; i < n; i++, p += RANGE_WIRE_SIZE) {
+    ranges[i].begin = GetU64(p);
+    ranges[i].end = GetU64(p + 8);
+    ranges[i].mod = GetU64(p + 16);
+  }
+  return n;
+}
+
+long DecodeResults(const char *frame, const struct FrameHeader *header,
+                   uint64_t *results, uint32_t max_results) {
+  const char *p = frame + FRAME_HEADER_SIZE;
+  size_t payload = header->length - FRAME_HEADER_SIZE;
+  if (header->type != FRAME_RESULT || payload < sizeof(uint32_t))
+    return -1;
+  uint32_t n = GetU32(p);
+  p += sizeof(uint32_t);
+  if (n > max_results || payload - sizeof(uint32_t) != (size_t)n * 8)
+    return -1;
+  for (uint32_t i = 0; i < n; i++, p += sizeof(uint64_t))
+    results[i] = GetU64(p);
+  return n;
+}
+
+bool DecodeReduce(const char *frame, const struct FrameHeader *header,
+                  struct ArraySlice *slice, uint32_t *deadline_ms) {
+  const char *p = frame + FRAME_HEADER_SIZE;
+  size_t payload = header->length - FRAME_HEADER_SIZE;
+  *deadline_ms = 0;
+  if (header->flags & FRAME_FLAG_DEADLINE) {
+    if (payload < sizeof(uint32_t))
+      return false;
+    *deadline_ms = GetU32(p);
+    p += sizeof(uint32_t);
+    payload -= sizeof(uint32_t);
+  }
+  if (header->type != FRAME_REDUCE || payload != REDUCE_WIRE_SIZE)
+    return false;
+  slice->begin = GetU64(p);
+  slice->end = GetU64(p + 8);
+  slice->seed = GetU32(p + 16);
+  return true;
+}
+
+bool DecodeStats(const char *frame, const struct FrameHeader *header,
+                 struct ArrayStats *stats) {
+  const char *p = frame + FRAME_HEADER_SIZE;
+  if (header->type != FRAME_STATS ||
+      header->length != FRAME_HEADER_SIZE + STATS_WIRE_SIZE)
+    return false;
+  stats->count = GetU64(p);
+  stats->min = (int)GetU32(p + 8);
+  stats->max = (int)GetU32(p + 12);
+  stats->sum = (unsigned __int128)GetU64(p + 24) << 64 | GetU64(p + 16);
+  return true;
+}
@@ -0,0 +1,117 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Every frame starts with a 16-byte header, all fields little-endian:
+//
+//   u32 length   whole frame in bytes, header included
+//   u8  version  PROTO_VERSION
+//   u8  type     enum FrameType
+//   u16 flags    FRAME_FLAG_*, zero in replies
+//   u64 id       chosen by the client, echoed in the reply
+//
+// and is followed by a type-specific payload. Requests flagged
+// FRAME_FLAG_DEADLINE carry a u32 budget in milliseconds first, counted
+// from when the server reads the frame; past it the server stops and
+// replies PROTO_ERR_EXPIRED.
+//
+//   FRAME_RANGE   u64 begin, u64 end, u64 mod
+//   FRAME_BATCH   u32 count, then count (begin, end, mod) triples
+//   FRAME_RESULT  u32 count, then count u64 products, in request order
+//   FRAME_ERROR   u32 code, then for PROTO_ERR_BUSY u32 retry_after_ms
+//   FRAME_REDUCE  u64 begin, u64 end, u32 seed: min, max and sum of
+//                 elements [begin, end) of lab4's GenerateArray(seed)
+//   FRAME_STATS   u64 count, u32 min, u32 max, u64 sum_lo, u64 sum_hi
+//   FRAME_CANCEL  no payload: stops the request with this id, which then
+//                 replies PROTO_ERR_EXPIRED unless it had already finished;
+//                 the cancel itself gets no reply
+//
+// A connection may carry any number of requests at once; replies come back
+// in completion order and are matched to requests by id.
+// A client may close its sending side and still read every reply; only a
+// reset or a failed send gives up on the requests still in flight.
+#define PROTO_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define MAX_FRAME_SIZE (1u << 20)
+#define RANGE_WIRE_SIZE (sizeof(uint64_t) * 3)
+#define ERROR_FRAME_SIZE (FRAME_HEADER_SIZE + sizeof(uint32_t) * 2)
+#define REDUCE_WIRE_SIZE (sizeof(uint64_t) * 2 + sizeof(uint32_t))
+#define STATS_WIRE_SIZE (sizeof(uint64_t) * 3 + sizeof(uint32_t) * 2)
+#define MAX_BATCH_RANGES \
+  ((MAX_FRAME_SIZE - FRAME_HEADER_SIZE - sizeof(uint32_t)) / RANGE_WIRE_SIZE)
+
+enum FrameType {
+  FRAME_RANGE = 1,
+  FRAME_BATCH = 2,
+  FRAME_RESULT = 3,
+  FRAME_ERROR = 4,
+  FRAME_REDUCE = 5,
+  FRAME_STATS = 6,
+  FRAME_CANCEL = 7,
+};
+
+#define FRAME_FLAG_DEADLINE 1
+
+enum ProtoError {
+  PROTO_ERR_MALFORMED = 1,
+  PROTO_ERR_BAD_RANGE = 2,
+  PROTO_ERR_EXPIRED = 3, // the deadline passed or the client cancelled it
+  PROTO_ERR_BUSY = 4,    // queue full, nothing was done; try again later
+};
+
+struct FrameHeader {
+  uint32_t length;
+  uint8_t version;
+  uint8_t type;
+  uint16_t flags;
+  uint64_t id;
+};
+
+// Makes room for need bytes in a malloc'ed buffer, doubling its capacity.
+bool GrowBuffer(char **buf, size_t *cap, size_t need);
+
+void PutU32(char *buf, uint32_t value);
+void PutU64(char *buf, uint64_t value);
+uint32_t GetU32(const char *buf);
+uint64_t GetU64(const char *buf);
+
+// Length of the frame at the start of buf: 0 if more bytes are needed, -1
+// if the header is not one this version understands.
+long FrameLength(const char *buf, size_t avail);
+void DecodeHeader(const char *buf, struct FrameHeader *header);
+
+// Encoders write into buf, which must have room for the returned size:
+// FrameSizeFor(n) for ranges and results, ERROR_FRAME_SIZE for errors,
+// FrameSizeFor(1) for the array frames, FRAME_HEADER_SIZE for a cancel.
+// deadline_ms 0 sends a request without a deadline.
+size_t FrameSizeFor(uint32_t n);
+size_t EncodeRanges(char *buf, uint64_t id, const struct FactorialArgs *ranges,
+                    uint32_t n, uint32_t deadline_ms);
+size_t EncodeResults(char *buf, uint64_t id, const uint64_t *results,
+                     uint32_t n);
+size_t EncodeReduce(char *buf, uint64_t id, const struct ArraySlice *slice,
+                    uint32_t deadline_ms);
+size_t EncodeStats(char *buf, uint64_t id, const struct ArrayStats *stats);
+size_t EncodeError(char *buf, uint64_t id, uint32_t code);
+size_t EncodeBusy(char *buf, uint64_t id, uint32_t retry_after_ms);
+size_t EncodeCancel(char *buf, uint64_t id);
+
+// Payload accessors for a complete frame of the given header. Return the
+// number of entries, or -1 (false for the array frames) if the payload
+// does not match its type. *deadline_ms is 0 for requests sent without one.
+long DecodeRanges(const char *frame, const struct FrameHeader *header,
+                  struct FactorialArgs *ranges, uint32_t max_ranges,
+                  uint32_t *deadline_ms);
+long DecodeResults(const char *frame, const struct FrameHeader *header,
+                   uint64_t *results, uint32_t max_results);
+bool DecodeReduce(const char *frame, const struct FrameHeader *header,
+                  struct ArraySlice *slice, uint32_t *deadline_ms);
+bool DecodeStats(const char *frame, const struct FrameHeader *header,
+                 struct ArrayStats *stats);
+
+#endif
@@ -0,0 +1,101 @@
+#include "randarray.h"
+
+#include <string.h>
+
+// Polynomials of degree < 31 over Z/2^32, kept modulo x^31 - x^28 - 1, the
+// characteristic polynomial of the recurrence: if x^n = sum a_i x^i then
+// s[n] = sum a_i s[i] for any sequence the recurrence generates.
+static void PolyMulMod(uint32_t *out, const uint32_t *a, const uint32_t *b) {
+  uint32_t prod[2 * RAND_DEGREE - 1] = {0};
+  for (int i = 0; i < RAND_DEGREE; i++) {
+    if (a[i] == 0)
+      continue;
+    for (int j = 0; j < RAND_DEGREE; j++)
+      prod[i + j] += a[i] * b[j];
+  }
+  for (int d = 2 * RAND_DEGREE - 2; d >= RAND_DEGREE; d--) {
+    prod[d - 3] += prod[d];
+    prod[d - RAND_DEGREE] += prod[d];
+  }
+  memcpy(out, prod, sizeof(uint32_t) * RAND_DEGREE);
+}
+
+static void PolyMulX(uint32_t *p) {
+  uint32_t top = p[RAND_DEGREE - 1];
+  memmove(p + 1, p, sizeof(uint32_t) * (RAND_DEGREE - 1));
+  p[0] = top;
+  p[RAND_DEGREE - 3] += top;
+}
+
+static void PolyPowX(uint32_t *out, uint64_t e) {
+  uint32_t base[RAND_DEGREE] = {0, 1};
+  memset(out, 0, sizeof(uint32_t) * RAND_DEGREE);
+  out[0] = 1;
+  for (; e > 0; e >>= 1) {
+    if (e & 1)
+      PolyMulMod(out, out, base);
+    PolyMulMod(base, base, base);
+  }
+}
+
+void RandSeek(struct RandStream *s, uint32_t seed, uint64_t index) {
+  // srandom_r: a Lehmer sequence in glibc's own signed arithmetic fills
+  // the first 31 values.
+  uint32_t init[RAND_DEGREE];
+  int32_t word = seed == 0 ? 1 : (int32_t)seed;
+  init[0] = (uint32_t)word;
+  for (int i = 1; i < RAND_DEGREE; i++) {
+    long hi = word / 127773, lo = word % 127773;
+    word = (int32_t)(16807 * lo - 2836 * hi);
+    if (word < 0)
+      word += 2147483647;
+    init[i] = (uint32_t)word;
+  }
+  // The first sum is r[3] + r[0], so the sequence the recurrence runs on
+  // starts s[0..30] = r[3..30], r[0..2]. srand throws away 310 outputs,
+  // and element index is s[index + 341] >> 1: load the 31 before it.
+  uint32_t s0[RAND_DEGREE];
+  memcpy(s0, init + 3, sizeof(uint32_t) * (RAND_DEGREE - 3));
+  memcpy(s0 + RAND_DEGREE - 3, init, sizeof(uint32_t) * 3);
+
+  uint32_t p[RAND_DEGREE];
+  PolyPowX(p, index + 310);
+  for (int j = 0; j < RAND_DEGREE; j++) {
+    uint32_t value = 0;
+    for (int i = 0; i < RAND_DEGREE; i++)
+      value += p[i] * s0[i];
+    s->r[j] = value;
+    PolyMulX(p);
+  }
+  s->front = 0;
+}
+
+void RandArrayStats(struct RandStream *s, uint64_t n,
+                    struct ArrayStats *stats) {
+  while (n > 0) {
+    // rand() < 2^31, so 2^32 of them sum to less than 2^64.
+    uint64_t chunk = n < (1ull << 32) ? n : 1ull << 32;
+    int min = RandNext(s), max = min;
+    uint64_t sum = (uint64_t)min;
+    for (uint64_t i = 1; i < chunk; i++) {
+      int value = RandNext(s);
+      min = value < min ? value : min;
+      max = value > max ? value : max;
+      sum += (uint64_t)value;
+    }
+    struct ArrayStats part = {chunk, min, max, sum};
+    MergeArrayStats(stats, &part);
+    n -= chunk;
+  }
+}
+
+void MergeArrayStats(struct ArrayStats *into, const struct ArrayStats *part) {
+  if (part->count == 0)
+    return;
+  if (into->count == 0 || part->min < into->min)
+    into->min = part->min;
+  if (into->count == 0 || part->max > into->max)
+    into->max = part->max;
+  into->count += part->count;
+  into->sum += part->sum;
+}
@@ -0,0 +1,37 @@
+#ifndef RANDARRAY_H
+#define RANDARRAY_H
+
+#include <stdint.h>
+
+#include "common.h"
+
+#define RAND_DEGREE 31
+
+// glibc's default rand(): r[i] = r[i - 3] + r[i - 31] mod 2^32, each
+// output r[i] >> 1. The recurrence is linear, so any position is reached
+// in O(31^2 log n) instead of n steps.
+struct RandStream {
+  uint32_t r[RAND_DEGREE]; // the last 31 values, oldest at front
+  int front;
+};
+
+// Positions s at element index of the array lab4's GenerateArray fills
+// for seed, i.e. the value of the (index + 1)-th rand() after srand(seed).
+void RandSeek(struct RandStream *s, uint32_t seed, uint64_t index);
+
+static inline int RandNext(struct RandStream *s) {
+  int back = s->front + RAND_DEGREE - 3;
+  if (back >= RAND_DEGREE)
+    back -= RAND_DEGREE;
+  uint32_t value = s->r[s->front] + s->r[back];
+  s->r[s->front] = value;
+  if (++s->front == RAND_DEGREE)
+    s->front = 0;
+  return (int)(value >> 1);
+}
+
+// Folds the next n elements of s into stats.
+void RandArrayStats(struct RandStream *s, uint64_t n, struct ArrayStats *stats);
+void MergeArrayStats(struct ArrayStats *into, const struct ArrayStats *part);
+
+#endif
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include <limits.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,52 +10,1464 @@
 #include <getopt.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include "pthread.h"
 
-struct FactorialArgs {
-  uint64_t begin;
-  uint64_t end;
-  uint64_t mod;
+#include "checkpoint.h"
+#include "cache.h"
+#include "common.h"
+#include "factmod.h"
+#include "metrics.h"
+#include "pool.h"
+#include "protocol.h"
+#include "randarray.h"
+#include "uring.h"
+
+// Ranges shorter than this are multiplied on the connection thread: a
+// queue round trip costs more than the multiplications themselves.
+#define INLINE_RANGE_TERMS (1 << 15)
+// Smallest slice worth its own pool task.
+#define MIN_TASK_TERMS (1 << 14)
+// Requests of at most this many terms (about 10 ms) take the small lane
+// and go ahead of larger ones; one request worker is kept for them.
+#define SMALL_REQUEST_TERMS (1 << 20)
+// Pool slices of a large range, so small work waits for one at most.
+#define LARGE_SLICE_TERMS (1 << 20)
+// Large work that has waited this long goes ahead of small work.
+#define MAX_LANE_WAIT_MS 200
+// Multiplications between two looks at a request's deadline and connection.
+#define CANCEL_CHECK_TERMS (1 << 16)
+#define MAX_EVENTS 64
+// Requests one connection may have queued or running before the server
+// stops reading from it.
+#define MAX_INFLIGHT 256
+// Bounds on the retry-after sent with a busy reply.
+#define MIN_RETRY_AFTER_MS 1
+#define MAX_RETRY_AFTER_MS 1000
+// Most terms one request counts against --max-queue (hours of work), so
+// the shared total can not wrap.
+#define MAX_CHARGED_TERMS (1ULL << 40)
+#define READ_CHUNK 65536
+// Largest metrics page the admin port serves.
+#define ADMIN_PAGE 16384
+// io_uring backend: submission queue depth and the provided receive
+// buffers multishot recv fills (4 MiB in all).
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 16384
+// Requests remembered per loop to answer UDP retransmits, and the longest
+// reply kept for them; longer ones are computed again, mostly from the
+// result cache.
+#define UDP_SEEN_SLOTS 1024
+#define UDP_REPLY_MAX 64
+// One frame per datagram.
+#define UDP_MAX_DATAGRAM 65536
+
+// One accepted client. Owned by the event loop; requests in flight keep it
+// alive after the socket is gone, and the last one to finish frees it.
+struct Connection {
+  struct EventLoop *loop;
+  int fd; // -1 once closed
+  char *in;
+  size_t in_len, in_cap;
+  char *out;
+  size_t out_len, out_sent, out_cap;
+  uint32_t events; // current epoll interest
+  int inflight;
+  bool eof; // peer finished sending
+  bool abandoned; // closed; workers drop its requests unlocked
+  struct Request *live; // in flight, for FRAME_CANCEL; loop thread only
+  // io_uring only: the kernel reads from sending while new replies queue
+  // up in out, and the connection outlives every SQE that points at it.
+  char *sending;
+  size_t sending_len, sending_sent, sending_cap;
+  int ops;
+  bool recv_armed, cancelling, send_busy;
+};
+
+// What an io_uring completion is for, kept in the low bits of user_data
+// next to the connection pointer.
+enum UringOp {
+  OP_ACCEPT = 1,
+  OP_RECV,
+  OP_SEND,
+  OP_DONE,
+  OP_ADMIN,
+  OP_CANCEL,
+  OP_UDP,
+};
+#define OP_MASK 7
+
+// Why a request may stop early. Once Cancelled turns true it stays true,
+// so a result is good if Cancelled is still false after computing it.
+struct Cancel {
+  const bool *abandoned;
+  const bool *cancelled;
+  uint64_t deadline_us; // 0 for none
+};
+
+// One decoded frame. ranges and results live in the same allocation;
+// an array request uses slice and stats instead.
+struct Request {
+  struct Connection *conn;
+  struct sockaddr_storage peer; // where a datagram's reply goes
+  socklen_t peer_len;           // 0 for streams
+  uint64_t id;
+  uint8_t type; // enum FrameType of the request
+  uint64_t deadline_us;
+  bool expired; // stopped early; answered with PROTO_ERR_EXPIRED if the
+                // connection is still open
+  bool cancelled; // by a FRAME_CANCEL; workers read it unlocked
+  struct Request *prev_live, *next_live;
+  uint32_t n;
+  struct FactorialArgs *ranges;
+  uint64_t *results;
+  struct ArraySlice slice;
+  struct ArrayStats stats;
+  uint64_t queued_us;
+  uint64_t terms; // counted against --max-queue
+  struct PoolTask task;
+  struct Request *next_done;
+};
+
+// A UDP request the loop has seen, found by sender and id.
+struct UdpSeen {
+  struct sockaddr_storage peer;
+  socklen_t peer_len;
+  uint64_t id;
+  bool answered;
+  uint16_t reply_len; // 0 if the reply was not kept
+  char reply[UDP_REPLY_MAX];
+};
+
+// One accept and event loop thread. A connection lives on the loop that
+// accepted it; with several loops each has its own SO_REUSEPORT socket and
+// the kernel spreads new connections between them.
+struct EventLoop {
+  pthread_t thread;
+  int cpu;     // pinned to this CPU, or -1
+  int epoll_fd;
+  int tcp_fd;  // -1 without --port
+  int unix_fd; // -1 except on the first loop with --unix
+  int admin_fd; // -1 except on the first loop with --admin-port
+  int udp_fd;  // -1 without --udp
+  struct Connection *udp_conn; // owns the requests that came as datagrams
+  struct UdpSeen *udp_seen;    // UDP_SEEN_SLOTS of them
+  int done_fd; // eventfd poked by workers when a reply is ready
+  pthread_mutex_t done_lock;
+  struct Request *done;
+  struct Uring ring;
+};
+
+struct ServerState {
+  int tnum;
+  enum FactAlgo algo;
+  const char *ckpt_dir;
+  bool verbose; // log every request to stdout
+  uint64_t max_queued; // terms admitted and not computed yet; 0 unbounded
+  uint64_t queued;     // shared by every loop and worker, atomic
+  uint64_t term_ps;    // moving average of compute time per term
+  struct ResultCache cache;
+  struct ThreadPool compute;  // slices of one long range
+  struct ThreadPool requests; // whole requests
+  bool uring; // io_uring backend instead of epoll, on every loop
+  const char *unix_path;
+  struct EventLoop *loops;
+  int nloops;
+};
+
+static struct ServerState state;
+// The loop running on this thread; NULL on workers, which find a
+// request's loop through its connection.
+static __thread struct EventLoop *loop;
+static volatile sig_atomic_t stopping;
+
+static bool Cancelled(const struct Cancel *cancel) {
+  return __atomic_load_n(cancel->abandoned, __ATOMIC_RELAXED) ||
+         __atomic_load_n(cancel->cancelled, __ATOMIC_RELAXED) ||
+         (cancel->deadline_us != 0 && MetricsNowUs() >= cancel->deadline_us);
+}
+
+uint64_t Factorial(const struct FactorialArgs *args,
+                   const struct Cancel *cancel) {
+  uint64_t ans = 1 % args->mod;
+
+  for (uint64_t i = args->begin; i <= args->end && ans != 0; i++) {
+    ans = MultModulo(ans, i, args->mod);
+    if ((i & (CANCEL_CHECK_TERMS - 1)) == 0 && Cancelled(cancel))
+      break;
+  }
+
+  return ans;
+}
+
+// A range of factorial terms, or of array elements when reduce is set,
+// split between pool workers.
+struct RangeJob {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int pending;
+  uint64_t next, left, slice; // the terms no task has claimed yet
+  struct ThreadPool *pool;
+  enum PoolLane lane;
+  uint64_t total;
+  uint64_t mod; // the seed for an array
+  bool reduce;
+  struct ArrayStats stats;
+};
+
+struct RangeTask {
+  struct PoolTask task;
+  struct RangeJob *job;
+  struct FactorialArgs args;
+  const struct Cancel *cancel;
 };
 
-uint64_t MultModulo(uint64_t a, uint64_t b, uint64_t mod) {
+static bool ClaimSlice(struct RangeJob *job, struct FactorialArgs *args) {
+  if (job->left == 0)
+    return false;
+  uint64_t n = job->left < job->slice ? job->left : job->slice;
+  *args = (struct FactorialArgs){job->next, job->next + n - 1, job->mod};
+  job->next += n;
+  job->left -= n;
+  return true;
+}
+
+// Folds elements [begin, end) of the array for seed into stats. Returns
+// false if cancelled first.
+static bool ReduceArray(uint64_t begin, uint64_t end, uint32_t seed,
+                        const struct Cancel *cancel,
+                        struct ArrayStats *stats) {
+  struct RandStream s;
+  RandSeek(&s, seed, begin);
+  while (begin < end) {
+    if (Cancelled(cancel))
+      return false;
+    uint64_t n = end - begin < CANCEL_CHECK_TERMS ? end - begin
+                                                  : CANCEL_CHECK_TERMS;
+    RandArrayStats(&s, n, stats);
+    begin += n;
+  }
+  return true;
+}
+
+static void RunRangeTask(void *arg) {
+  struct RangeTask *t = arg;
+  struct RangeJob *job = t->job;
   uint64_t result = 0;
-  a = a % mod;
-  while (b > 0) {
-    if (b % 2 == 1)
-      result = (result + a) % mod;
-    a = (a * 2) % mod;
-    b /= 2;
+  struct ArrayStats part = {0};
+  if (job->reduce)
+    ReduceArray(t->args.begin, t->args.end + 1, (uint32_t)job->mod, t->cancel,
+                &part);
+  else
+    result = Factorial(&t->args, t->cancel);
+
+  pthread_mutex_lock(&job->lock);
+  if (job->reduce)
+    MergeArrayStats(&job->stats, &part);
+  else
+    job->total = MultModulo(job->total, result, job->mod);
+  // The next slice queues again, behind whatever came in meanwhile.
+  if (!Cancelled(t->cancel) && ClaimSlice(job, &t->args)) {
+    pthread_mutex_unlock(&job->lock);
+    PoolSubmit(job->pool, &t->task, job->lane);
+    return;
   }
+  if (--job->pending == 0)
+    pthread_cond_signal(&job->done);
+  pthread_mutex_unlock(&job->lock);
+}
 
-  return result % mod;
+static enum PoolLane LaneFor(uint64_t terms) {
+  return terms <= SMALL_REQUEST_TERMS ? POOL_LANE_SMALL : POOL_LANE_LARGE;
 }
 
-uint64_t Factorial(const struct FactorialArgs *args) {
-  uint64_t ans = 1;
+// Splits the len terms of job from begin into slices sized by their cost
+// (one multiplication or one rand() per term) and runs them on the pool's
+// workers, at most one per worker at a time, then waits for all of them.
+// A large range is cut into LARGE_SLICE_TERMS slices so small work can run
+// between them.
+static void RunRangeJob(struct ThreadPool *pool, struct RangeJob *job,
+                        uint64_t begin, uint64_t len,
+                        const struct Cancel *cancel) {
+  uint64_t ntasks = len / MIN_TASK_TERMS;
+  if (ntasks > (uint64_t)pool->nthreads)
+    ntasks = pool->nthreads;
 
-  // TODO: your code here
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->done, NULL);
+  job->pending = (int)ntasks;
+  job->next = begin;
+  job->left = len;
+  job->slice = len / ntasks + (len % ntasks != 0);
+  job->pool = pool;
+  job->lane = LaneFor(len);
+  if (job->lane == POOL_LANE_LARGE && job->slice > LARGE_SLICE_TERMS)
+    job->slice = LARGE_SLICE_TERMS;
 
-  return ans;
+  // Every task has its first slice before any runs and claims more.
+  struct RangeTask tasks[ntasks];
+  for (uint64_t i = 0; i < ntasks; i++) {
+    tasks[i].task.run = RunRangeTask;
+    tasks[i].task.arg = &tasks[i];
+    tasks[i].job = job;
+    tasks[i].cancel = cancel;
+    ClaimSlice(job, &tasks[i].args);
+  }
+  for (uint64_t i = 0; i < ntasks; i++)
+    PoolSubmit(pool, &tasks[i].task, job->lane);
+
+  pthread_mutex_lock(&job->lock);
+  while (job->pending > 0)
+    pthread_cond_wait(&job->done, &job->lock);
+  pthread_mutex_unlock(&job->lock);
+
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->done);
+}
+
+// begin * ... * end modulo mod, on the pool's workers if it is long.
+uint64_t PoolFactorial(struct ThreadPool *pool, uint64_t begin, uint64_t end,
+                       uint64_t mod, const struct Cancel *cancel) {
+  struct FactorialArgs whole = {begin, end, mod};
+  uint64_t len = end - begin + 1;
+  if (len < INLINE_RANGE_TERMS || pool->nthreads < 2)
+    return Factorial(&whole, cancel);
+
+  struct RangeJob job = {.total = 1 % mod, .mod = mod};
+  RunRangeJob(pool, &job, begin, len, cancel);
+  return job.total;
+}
+
+// Min, max and sum of an array slice, computed where it is generated: the
+// elements never exist anywhere but in a worker's registers.
+static bool PoolReduce(struct ThreadPool *pool, const struct ArraySlice *slice,
+                       const struct Cancel *cancel, struct ArrayStats *stats) {
+  uint64_t len = slice->end - slice->begin;
+  if (len < INLINE_RANGE_TERMS || pool->nthreads < 2)
+    return ReduceArray(slice->begin, slice->end, slice->seed, cancel, stats);
+
+  struct RangeJob job = {.mod = slice->seed, .reduce = true};
+  RunRangeJob(pool, &job, slice->begin, len, cancel);
+  *stats = job.stats;
+  return !Cancelled(cancel);
+}
+
+// Blocks the checkpoint store lacks, on the compute pool. They are
+// recorded, so they always run to the end.
+static uint64_t CheckpointBlock(void *ctx, uint64_t begin, uint64_t end,
+                                uint64_t mod) {
+  static const bool never = false;
+  const struct Cancel whole = {&never, &never, 0};
+  return PoolFactorial(&state.compute, begin, end, mod, &whole);
+}
+
+// Only the plain product looks at cancel. The fast path can not be stopped
+// once started, so it is taken only when its estimated cost is below the
+// range length (or under --algo fast). The checkpointed path records every
+// block it computes, so it always runs to the end.
+static uint64_t ComputeRange(uint64_t begin, uint64_t end, uint64_t mod,
+                             const struct Cancel *cancel) {
+  uint64_t len = begin <= end ? end - begin + 1 : 0;
+  struct CheckpointStore *store = NULL;
+  if (len == 0)
+    return 1 % mod;
+  if (FactUseFastRange(begin, end, mod, state.algo))
+    return RangeProductModPrime(begin, end, mod);
+  if (state.ckpt_dir != NULL &&
+      (store = CheckpointStoreFor(state.ckpt_dir, mod)) != NULL) {
+    uint64_t total =
+        CheckpointRangeProductWith(store, begin, end, CheckpointBlock, NULL);
+    if (state.verbose)
+      CheckpointPrintStats(store);
+    return total;
+  }
+  return PoolFactorial(&state.compute, begin, end, mod, cancel);
+}
+
+static bool ComputeArgs(const struct FactorialArgs *args, void *ctx,
+                        uint64_t *value) {
+  const struct Cancel *cancel = ctx;
+  *value = ComputeRange(args->begin, args->end, args->mod, cancel);
+  return !Cancelled(cancel);
+}
+
+static void RunRequest(void *arg) {
+  struct Request *req = arg;
+  uint64_t start = MetricsNowUs();
+  MetricRecord(HIST_QUEUE_WAIT, start - req->queued_us);
+  struct Cancel cancel = {&req->conn->abandoned, &req->cancelled,
+                          req->deadline_us};
+  if (req->type == FRAME_REDUCE) {
+    const struct ArraySlice *a = &req->slice;
+    if (state.verbose)
+      printf("Reduce: %llu %llu %u\n", (unsigned long long)a->begin,
+             (unsigned long long)a->end, a->seed);
+    req->expired = !PoolReduce(&state.compute, a, &cancel, &req->stats);
+  }
+  for (uint32_t i = 0; i < req->n && req->type != FRAME_REDUCE; i++) {
+    const struct FactorialArgs *r = &req->ranges[i];
+    if (state.verbose)
+      printf("Receive: %llu %llu %llu\n", r->begin, r->end, r->mod);
+    if (Cancelled(&cancel) ||
+        !CacheRangeProduct(&state.cache, r, ComputeArgs, &cancel,
+                           &req->results[i])) {
+      req->expired = true;
+      break;
+    }
+    if (state.verbose)
+      printf("Total: %llu\n", req->results[i]);
+  }
+  uint64_t elapsed = MetricsNowUs() - start;
+  MetricRecord(HIST_COMPUTE, elapsed);
+  if (!req->expired && req->terms > 0) {
+    uint64_t avg = __atomic_load_n(&state.term_ps, __ATOMIC_RELAXED);
+    uint64_t ps = elapsed * 1000000 / req->terms;
+    __atomic_store_n(&state.term_ps, avg - avg / 8 + ps / 8,
+                     __ATOMIC_RELAXED);
+  }
+  __atomic_sub_fetch(&state.queued, req->terms, __ATOMIC_RELAXED);
+  if (state.verbose)
+    CachePrintStats(&state.cache);
+
+  struct EventLoop *home = req->conn->loop;
+  pthread_mutex_lock(&home->done_lock);
+  req->next_done = home->done;
+  home->done = req;
+  pthread_mutex_unlock(&home->done_lock);
+
+  uint64_t one = 1;
+  if (write(home->done_fd, &one, sizeof(one)) < 0)
+    perror("write");
+}
+
+static bool OutputPending(const struct Connection *conn) {
+  return conn->out_sent < conn->out_len ||
+         conn->sending_sent < conn->sending_len;
+}
+
+static struct io_uring_sqe *QueueSqe(uint8_t opcode, int fd, void *ptr,
+                                     enum UringOp op) {
+  struct io_uring_sqe *sqe = UringGetSqe(&loop->ring);
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = (uint64_t)(uintptr_t)ptr | op;
+  return sqe;
+}
+
+// The listening descriptor rides in user_data in place of a pointer.
+static uint64_t AcceptTag(int fd) { return (uint64_t)fd << 3 | OP_ACCEPT; }
+
+static void ArmAccept(int fd) {
+  struct io_uring_sqe *sqe = QueueSqe(IORING_OP_ACCEPT, fd, NULL, OP_ACCEPT);
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = AcceptTag(fd);
+}
+
+static void ArmPoll(int fd, enum UringOp op) {
+  struct io_uring_sqe *sqe = QueueSqe(IORING_OP_POLL_ADD, fd, NULL, op);
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+// Keeps one multishot recv armed while the connection may read, and
+// cancels it while the connection is at its in-flight limit.
+static void UpdateUringInterest(struct Connection *conn) {
+  bool want = conn->fd >= 0 && !conn->eof && conn->inflight < MAX_INFLIGHT;
+  if (want && !conn->recv_armed) {
+    struct io_uring_sqe *sqe = QueueSqe(IORING_OP_RECV, conn->fd, conn,
+                                        OP_RECV);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = loop->ring.bgid;
+    conn->recv_armed = true;
+    conn->ops++;
+  } else if (!want && conn->recv_armed && !conn->cancelling &&
+             conn->fd >= 0) {
+    struct io_uring_sqe *sqe = QueueSqe(IORING_OP_ASYNC_CANCEL, -1, NULL,
+                                        OP_CANCEL);
+    sqe->addr = (uint64_t)(uintptr_t)conn | OP_RECV;
+    conn->cancelling = true;
+  }
+}
+
+static void StartSend(struct Connection *conn) {
+  if (conn->send_busy || conn->fd < 0)
+    return;
+  if (conn->sending_sent == conn->sending_len && conn->out_len > 0) {
+    char *buf = conn->sending;
+    size_t cap = conn->sending_cap;
+    conn->sending = conn->out;
+    conn->sending_cap = conn->out_cap;
+    conn->sending_len = conn->out_len;
+    conn->sending_sent = 0;
+    conn->out = buf;
+    conn->out_cap = cap;
+    conn->out_len = conn->out_sent = 0;
+  }
+  if (conn->sending_sent == conn->sending_len)
+    return;
+  struct io_uring_sqe *sqe = QueueSqe(IORING_OP_SEND, conn->fd, conn,
+                                      OP_SEND);
+  sqe->addr = (uint64_t)(uintptr_t)(conn->sending + conn->sending_sent);
+  sqe->len = (uint32_t)(conn->sending_len - conn->sending_sent);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  conn->send_busy = true;
+  conn->ops++;
+}
+
+static void UpdateInterest(struct Connection *conn) {
+  if (state.uring) {
+    UpdateUringInterest(conn);
+    return;
+  }
+  uint32_t events = 0;
+  if (!conn->eof && conn->inflight < MAX_INFLIGHT)
+    events |= EPOLLIN;
+  if (conn->out_sent < conn->out_len)
+    events |= EPOLLOUT;
+  if (events == conn->events)
+    return;
+  conn->events = events;
+  struct epoll_event ev = {.events = events, .data.ptr = conn};
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void FreeConnection(struct Connection *conn) {
+  free(conn->in);
+  free(conn->out);
+  free(conn->sending);
+  free(conn);
+}
+
+// Frees a closed connection once no request or SQE refers to it.
+static void ReleaseConnection(struct Connection *conn) {
+  if (conn->fd < 0 && conn->inflight == 0 && conn->ops == 0)
+    FreeConnection(conn);
+}
+
+static void CloseConnection(struct Connection *conn) {
+  if (conn->fd >= 0) {
+    MetricAdd(METRIC_CLOSED, 1);
+    __atomic_store_n(&conn->abandoned, true, __ATOMIC_RELAXED);
+    if (!state.uring)
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    // Also completes a pending io_uring recv or send, which hold their
+    // own reference to the socket.
+    shutdown(conn->fd, SHUT_RDWR);
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  ReleaseConnection(conn);
+}
+
+// A client may half-close once it has sent every request and then read
+// the replies, so everything in flight is still computed. Only a real
+// disconnect (a reset, a read or send error) abandons it.
+static void MarkEof(struct Connection *conn) { conn->eof = true; }
+
+// Takes over a freshly accepted socket.
+static void AddConnection(int fd) {
+  struct Connection *conn = calloc(1, sizeof(*conn));
+  if (conn == NULL || (!state.uring && fcntl(fd, F_SETFL, O_NONBLOCK) < 0)) {
+    free(conn);
+    close(fd);
+    return;
+  }
+  // Fails harmlessly on Unix sockets, which have no Nagle to turn off.
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  conn->fd = fd;
+  conn->loop = loop;
+  if (state.uring) {
+    UpdateUringInterest(conn);
+  } else {
+    conn->events = EPOLLIN;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close(fd);
+      free(conn);
+      return;
+    }
+  }
+  MetricAdd(METRIC_CONNECTIONS, 1);
+}
+
+static void AcceptConnections(int server_fd) {
+  while (true) {
+    int fd = accept(server_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        fprintf(stderr, "Could not establish new connection\n");
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    AddConnection(fd);
+  }
+}
+
+// Answers every pending admin connection with one metrics page and hangs
+// up. The page fits in a fresh socket buffer, so the loop never waits.
+static void ServeAdmin(void) {
+  static char page[ADMIN_PAGE];
+  while (true) {
+    int fd = accept(loop->admin_fd, NULL, NULL);
+    if (fd < 0 && errno == EINTR)
+      continue;
+    if (fd < 0)
+      return;
+
+    size_t len = MetricsRender(page, sizeof(page));
+    struct CacheStats st;
+    size_t count;
+    CacheGetStats(&state.cache, &st, &count);
+    len += (size_t)snprintf(
+        page + len, sizeof(page) - len,
+        "cache_hits_total %llu\ncache_coalesced_total %llu\n"
+        "cache_misses_total %llu\ncache_terms_saved_total %llu\n"
+        "cache_evictions_total %llu\ncache_entries %zu\n"
+        "queued_terms %llu\n",
+        (unsigned long long)st.hits, (unsigned long long)st.coalesced,
+        (unsigned long long)st.misses, (unsigned long long)st.terms_saved,
+        (unsigned long long)st.evictions, count,
+        (unsigned long long)__atomic_load_n(&state.queued, __ATOMIC_RELAXED));
+    if (len > sizeof(page))
+      len = sizeof(page);
+    if (send(fd, page, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+      perror("send");
+    close(fd);
+  }
+}
+
+static bool QueueReply(struct Connection *conn, const char *frame,
+                       size_t len) {
+  if (conn->out_sent == conn->out_len)
+    conn->out_len = conn->out_sent = 0;
+  if (!GrowBuffer(&conn->out, &conn->out_cap, conn->out_len + len))
+    return false;
+  memcpy(conn->out + conn->out_len, frame, len);
+  conn->out_len += len;
+  return true;
+}
+
+// Sends as much queued output as the socket takes. Returns false if the
+// connection died. With io_uring the send only starts here and finishes
+// in OnSend.
+static bool FlushReplies(struct Connection *conn) {
+  if (state.uring) {
+    StartSend(conn);
+    return true;
+  }
+  while (conn->out_sent < conn->out_len) {
+    ssize_t n = send(conn->fd, conn->out + conn->out_sent,
+                     conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n < 0) {
+      fprintf(stderr, "Can't send data to client\n");
+      return false;
+    }
+    MetricAdd(METRIC_BYTES_OUT, (uint64_t)n);
+    conn->out_sent += (size_t)n;
+  }
+  return true;
+}
+
+// Counts a request's terms against --max-queue, or refuses it. A request
+// larger than the limit still gets in when nothing else is queued.
+static bool Admit(uint64_t terms) {
+  uint64_t queued = __atomic_add_fetch(&state.queued, terms, __ATOMIC_RELAXED);
+  if (state.max_queued == 0 || queued <= state.max_queued || queued == terms)
+    return true;
+  __atomic_sub_fetch(&state.queued, terms, __ATOMIC_RELAXED);
+  return false;
+}
+
+// About how long the workers need to get through half of what is queued
+// now; waiting for all of it would leave them idle until the retries land.
+static uint32_t RetryAfterMs(void) {
+  uint64_t queued = __atomic_load_n(&state.queued, __ATOMIC_RELAXED);
+  uint64_t term_ps = __atomic_load_n(&state.term_ps, __ATOMIC_RELAXED);
+  double ms = (double)queued * term_ps / state.tnum / 2e9;
+  if (ms < MIN_RETRY_AFTER_MS)
+    return MIN_RETRY_AFTER_MS;
+  return ms < MAX_RETRY_AFTER_MS ? (uint32_t)ms : MAX_RETRY_AFTER_MS;
+}
+
+static struct UdpSeen *UdpSlot(const struct sockaddr_storage *peer,
+                               socklen_t peer_len, uint64_t id) {
+  uint64_t h = id * 0x9e3779b97f4a7c15ULL;
+  const unsigned char *bytes = (const unsigned char *)peer;
+  for (socklen_t i = 0; i < peer_len; i++)
+    h = (h ^ bytes[i]) * 0x100000001b3ULL;
+  return &loop->udp_seen[(h ^ (h >> 29)) & (UDP_SEEN_SLOTS - 1)];
+}
+
+static bool SameRequest(const struct UdpSeen *seen,
+                        const struct sockaddr_storage *peer,
+                        socklen_t peer_len, uint64_t id) {
+  return seen->id == id && seen->peer_len == peer_len &&
+         memcmp(&seen->peer, peer, peer_len) == 0;
 }
 
-void *ThreadFactorial(void *args) {
-  struct FactorialArgs *fargs = (struct FactorialArgs *)args;
-  return (void *)(uint64_t *)Factorial(fargs);
+// Streams queue the frame behind earlier replies; a datagram goes straight
+// back to its sender and is kept for retransmits of the same request.
+static bool SendReply(struct Connection *conn,
+                      const struct sockaddr_storage *peer, socklen_t peer_len,
+                      uint64_t id, const char *frame, size_t len) {
+  if (peer_len == 0)
+    return QueueReply(conn, frame, len);
+  if (sendto(conn->fd, frame, len, MSG_DONTWAIT,
+             (const struct sockaddr *)peer, peer_len) == (ssize_t)len)
+    MetricAdd(METRIC_BYTES_OUT, len);
+  struct UdpSeen *seen = UdpSlot(peer, peer_len, id);
+  if (SameRequest(seen, peer, peer_len, id)) {
+    seen->answered = true;
+    seen->reply_len = len <= UDP_REPLY_MAX ? (uint16_t)len : 0;
+    memcpy(seen->reply, frame, seen->reply_len);
+  }
+  return true;
+}
+
+// Stops the request the peer has in flight under id, if it still does.
+static void CancelRequest(struct Connection *conn, uint64_t id,
+                          const struct sockaddr_storage *peer,
+                          socklen_t peer_len) {
+  for (struct Request *req = conn->live; req != NULL; req = req->next_live) {
+    if (req->id == id && req->peer_len == peer_len &&
+        (peer_len == 0 || memcmp(&req->peer, peer, peer_len) == 0))
+      __atomic_store_n(&req->cancelled, true, __ATOMIC_RELAXED);
+  }
+}
+
+// Turns one complete frame into a request for the workers, or answers it
+// straight away with an error. Returns false for frames that leave the
+// stream unusable.
+static bool DispatchFrame(struct Connection *conn, const char *frame,
+                          const struct sockaddr_storage *peer,
+                          socklen_t peer_len) {
+  struct FrameHeader header;
+  DecodeHeader(frame, &header);
+  if (header.type == FRAME_CANCEL) {
+    CancelRequest(conn, header.id, peer, peer_len);
+    return true;
+  }
+
+  uint32_t max_ranges = header.type == FRAME_BATCH ? MAX_BATCH_RANGES : 1;
+  size_t count_at = FRAME_HEADER_SIZE;
+  if (header.flags & FRAME_FLAG_DEADLINE)
+    count_at += sizeof(uint32_t);
+  uint32_t n = 1;
+  if (header.type == FRAME_BATCH &&
+      header.length >= count_at + sizeof(uint32_t))
+    n = GetU32(frame + count_at);
+  if (n == 0 || n > max_ranges)
+    n = 1;
+
+  struct Request *req = malloc(sizeof(*req) + n * (sizeof(struct FactorialArgs) +
+                                                   sizeof(uint64_t)));
+  if (req == NULL)
+    return false;
+  req->ranges = (struct FactorialArgs *)(req + 1);
+  req->results = (uint64_t *)(req->ranges + n);
+  req->conn = conn;
+  req->peer_len = peer_len;
+  if (peer_len > 0)
+    memcpy(&req->peer, peer, peer_len);
+  req->id = header.id;
+  req->type = header.type;
+
+  char reply[ERROR_FRAME_SIZE];
+  uint32_t deadline_ms;
+  long decoded;
+  if (header.type == FRAME_REDUCE)
+    decoded = DecodeReduce(frame, &header, &req->slice, &deadline_ms) ? 1 : -1;
+  else
+    decoded = DecodeRanges(frame, &header, req->ranges, n, &deadline_ms);
+  uint32_t error = decoded <= 0 ? PROTO_ERR_MALFORMED : 0;
+  for (long i = 0; i < decoded && error == 0; i++) {
+    if (header.type == FRAME_REDUCE ? req->slice.begin > req->slice.end
+                                    : req->ranges[i].mod == 0)
+      error = PROTO_ERR_BAD_RANGE;
+  }
+  if (error != 0) {
+    MetricAdd(METRIC_ERRORS, 1);
+    fprintf(stderr, "Rejecting request %llu: error %u\n",
+            (unsigned long long)header.id, error);
+    free(req);
+    return SendReply(conn, peer, peer_len, header.id, reply,
+                     EncodeError(reply, header.id, error));
+  }
+
+  req->n = (uint32_t)decoded;
+  uint64_t terms = 0;
+  if (header.type == FRAME_REDUCE)
+    terms = req->slice.end - req->slice.begin;
+  for (uint32_t i = 0; i < req->n && header.type != FRAME_REDUCE; i++) {
+    const struct FactorialArgs *r = &req->ranges[i];
+    uint64_t len = r->end - r->begin; // one less than the terms
+    if (r->begin <= r->end)
+      terms = len < UINT64_MAX - terms ? terms + len + 1 : UINT64_MAX;
+  }
+  req->terms = terms < MAX_CHARGED_TERMS ? terms : MAX_CHARGED_TERMS;
+  if (!Admit(req->terms)) {
+    MetricAdd(METRIC_REJECTED, 1);
+    free(req);
+    return SendReply(conn, peer, peer_len, header.id, reply,
+                     EncodeBusy(reply, header.id, RetryAfterMs()));
+  }
+  req->queued_us = MetricsNowUs();
+  req->deadline_us =
+      deadline_ms != 0 ? req->queued_us + (uint64_t)deadline_ms * 1000 : 0;
+  req->expired = false;
+  req->cancelled = false;
+  req->prev_live = NULL;
+  req->next_live = conn->live;
+  if (conn->live != NULL)
+    conn->live->prev_live = req;
+  conn->live = req;
+  memset(&req->stats, 0, sizeof(req->stats));
+  req->task.run = RunRequest;
+  req->task.arg = req;
+  conn->inflight++;
+  MetricAdd(METRIC_REQUESTS, 1);
+  MetricAdd(METRIC_RANGES, req->n);
+  PoolSubmit(&state.requests, &req->task, LaneFor(terms));
+  return true;
+}
+
+// Every datagram holds one whole frame. A retransmit of a request still
+// being computed is dropped, and one already answered gets the reply again.
+static void ReadDatagrams(void) {
+  static __thread char buf[UDP_MAX_DATAGRAM];
+  while (true) {
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    ssize_t n = recvfrom(loop->udp_fd, buf, sizeof(buf), MSG_DONTWAIT,
+                         (struct sockaddr *)&peer, &peer_len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return;
+    MetricAdd(METRIC_BYTES_IN, (uint64_t)n);
+    if (FrameLength(buf, (size_t)n) != n) {
+      MetricAdd(METRIC_ERRORS, 1);
+      continue;
+    }
+
+    struct FrameHeader header;
+    DecodeHeader(buf, &header);
+    // A cancel shares its id with the request it names.
+    if (header.type == FRAME_CANCEL) {
+      DispatchFrame(loop->udp_conn, buf, &peer, peer_len);
+      continue;
+    }
+    struct UdpSeen *seen = UdpSlot(&peer, peer_len, header.id);
+    if (SameRequest(seen, &peer, peer_len, header.id)) {
+      if (!seen->answered)
+        continue;
+      if (seen->reply_len > 0) {
+        if (sendto(loop->udp_fd, seen->reply, seen->reply_len, MSG_DONTWAIT,
+                   (struct sockaddr *)&peer, peer_len) == seen->reply_len)
+          MetricAdd(METRIC_BYTES_OUT, seen->reply_len);
+        continue;
+      }
+    }
+    memcpy(&seen->peer, &peer, peer_len);
+    seen->peer_len = peer_len;
+    seen->id = header.id;
+    seen->answered = false;
+    seen->reply_len = 0;
+    DispatchFrame(loop->udp_conn, buf, &peer, peer_len);
+  }
+}
+
+// Dispatches every complete buffered frame and reads more while the
+// connection is under its in-flight limit. Returns false if the connection
+// is done.
+static bool ParseFrames(struct Connection *conn) {
+  size_t used = 0;
+  while (conn->inflight < MAX_INFLIGHT) {
+    long len = FrameLength(conn->in + used, conn->in_len - used);
+    if (len < 0) {
+      MetricAdd(METRIC_ERRORS, 1);
+      fprintf(stderr, "Client send wrong data format\n");
+      return false;
+    }
+    if (len == 0)
+      break;
+    if (!DispatchFrame(conn, conn->in + used, NULL, 0))
+      return false;
+    used += (size_t)len;
+  }
+  memmove(conn->in, conn->in + used, conn->in_len - used);
+  conn->in_len -= used;
+  return true;
+}
+
+static bool ReadRequests(struct Connection *conn) {
+  // io_uring has already received the bytes into conn->in.
+  while (!state.uring) {
+    if (!ParseFrames(conn))
+      return false;
+    if (conn->inflight >= MAX_INFLIGHT || conn->eof)
+      break;
+
+    if (!GrowBuffer(&conn->in, &conn->in_cap, conn->in_len + READ_CHUNK))
+      return false;
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len, READ_CHUNK, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n < 0) {
+      fprintf(stderr, "Client read failed\n");
+      return false;
+    }
+    if (n == 0) {
+      MarkEof(conn);
+      if (conn->in_len > 0) {
+        MetricAdd(METRIC_ERRORS, 1);
+        fprintf(stderr, "Client send wrong data format\n");
+      }
+      break;
+    }
+    MetricAdd(METRIC_BYTES_IN, (uint64_t)n);
+    conn->in_len += (size_t)n;
+  }
+  if (state.uring) {
+    if (!ParseFrames(conn))
+      return false;
+    if (conn->eof && conn->in_len > 0 && conn->inflight < MAX_INFLIGHT) {
+      MetricAdd(METRIC_ERRORS, 1);
+      fprintf(stderr, "Client send wrong data format\n");
+      conn->in_len = 0;
+    }
+  }
+
+  if (!FlushReplies(conn))
+    return false;
+  if (conn->eof && conn->inflight == 0 && !OutputPending(conn))
+    return false;
+  UpdateInterest(conn);
+  return true;
+}
+
+static int Listen(int fd, const struct sockaddr *addr, socklen_t len,
+                  const char *name) {
+  if (bind(fd, addr, len) < 0) {
+    fprintf(stderr, "Can not bind to %s!\n", name);
+    close(fd);
+    return -1;
+  }
+  if (listen(fd, 128) < 0) {
+    fprintf(stderr, "Could not listen on socket\n");
+    close(fd);
+    return -1;
+  }
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+    fprintf(stderr, "Could not make server socket nonblocking\n");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// A nonblocking socket listening on every interface, or -1.
+// reuse_port lets every event loop bind its own socket to the port.
+static int OpenListener(int port, bool reuse_port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Can not create server socket!");
+    return -1;
+  }
+
+  struct sockaddr_in server;
+  server.sin_family = AF_INET;
+  server.sin_port = htons((uint16_t)port);
+  server.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  int opt_val = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val));
+  if (reuse_port &&
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt_val, sizeof(opt_val)) < 0) {
+    perror("SO_REUSEPORT");
+    close(fd);
+    return -1;
+  }
+
+  char name[32];
+  snprintf(name, sizeof(name), "port %d", port);
+  return Listen(fd, (struct sockaddr *)&server, sizeof(server), name);
+}
+
+// A nonblocking UDP socket bound to port, with SO_REUSEPORT when there are
+// several loops, or -1.
+static int OpenUdpSocket(int port, bool reuse_port) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Can not create UDP socket!");
+    return -1;
+  }
+  int opt_val = 1;
+  if (reuse_port &&
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt_val, sizeof(opt_val)) < 0) {
+    perror("SO_REUSEPORT");
+    close(fd);
+    return -1;
+  }
+
+  struct sockaddr_in server;
+  server.sin_family = AF_INET;
+  server.sin_port = htons((uint16_t)port);
+  server.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+    fprintf(stderr, "Can not bind to UDP port %d!\n", port);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// A nonblocking Unix stream socket listening at path, or -1. A socket file
+// left behind by a server that is gone is replaced; a live one is not.
+static int OpenUnixListener(const char *path) {
+  struct sockaddr_un server;
+  memset(&server, 0, sizeof(server));
+  server.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(server.sun_path)) {
+    fprintf(stderr, "Unix socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(server.sun_path, path);
+
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool live = probe >= 0 &&
+                connect(probe, (struct sockaddr *)&server, sizeof(server)) == 0;
+    if (probe >= 0)
+      close(probe);
+    if (live) {
+      fprintf(stderr, "Another server is listening at %s\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Can not create server socket!");
+    return -1;
+  }
+
+  char name[sizeof(server.sun_path) + 8];
+  snprintf(name, sizeof(name), "unix:%s", path);
+  return Listen(fd, (struct sockaddr *)&server, sizeof(server), name);
+}
+
+static void DeliverReplies(void) {
+  uint64_t count;
+  if (read(loop->done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("read");
+
+  pthread_mutex_lock(&loop->done_lock);
+  struct Request *req = loop->done;
+  loop->done = NULL;
+  pthread_mutex_unlock(&loop->done_lock);
+
+  while (req != NULL) {
+    struct Request *next = req->next_done;
+    struct Connection *conn = req->conn;
+    if (req->prev_live != NULL)
+      req->prev_live->next_live = req->next_live;
+    else
+      conn->live = req->next_live;
+    if (req->next_live != NULL)
+      req->next_live->prev_live = req->prev_live;
+    conn->inflight--;
+    MetricRecord(HIST_LATENCY, MetricsNowUs() - req->queued_us);
+    if (req->expired)
+      MetricAdd(METRIC_CANCELLED, 1);
+    if (conn->fd < 0) {
+      ReleaseConnection(conn);
+    } else {
+      char *frame = malloc(FrameSizeFor(req->n));
+      size_t len = 0;
+      if (frame != NULL && req->expired)
+        len = EncodeError(frame, req->id, PROTO_ERR_EXPIRED);
+      else if (frame != NULL && req->type == FRAME_REDUCE)
+        len = EncodeStats(frame, req->id, &req->stats);
+      else if (frame != NULL)
+        len = EncodeResults(frame, req->id, req->results, req->n);
+      if (req->peer_len > 0) {
+        if (frame != NULL)
+          SendReply(conn, &req->peer, req->peer_len, req->id, frame, len);
+        free(frame);
+      } else {
+        bool alive = frame != NULL && QueueReply(conn, frame, len) &&
+                     FlushReplies(conn);
+        free(frame);
+        // Frames held back by the in-flight limit can go out now.
+        if (alive && conn->in_len >= FRAME_HEADER_SIZE)
+          alive = ReadRequests(conn);
+        else if (alive && conn->eof && conn->inflight == 0 &&
+                 !OutputPending(conn))
+          alive = false;
+        if (alive)
+          UpdateInterest(conn);
+        else
+          CloseConnection(conn);
+      }
+    }
+    free(req);
+    req = next;
+  }
+}
+
+static void OnRecv(struct Connection *conn, const struct io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    conn->recv_armed = conn->cancelling = false;
+    conn->ops--;
+  }
+  bool alive = conn->fd >= 0;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (alive && cqe->res > 0) {
+      alive = GrowBuffer(&conn->in, &conn->in_cap, conn->in_len + cqe->res);
+      if (alive) {
+        memcpy(conn->in + conn->in_len, UringBuffer(&loop->ring, bid),
+               cqe->res);
+        conn->in_len += (size_t)cqe->res;
+        MetricAdd(METRIC_BYTES_IN, (uint64_t)cqe->res);
+      }
+    }
+    UringRecycleBuffer(&loop->ring, bid);
+  }
+  if (conn->fd < 0) {
+    ReleaseConnection(conn);
+    return;
+  }
+
+  if (cqe->res == 0) {
+    MarkEof(conn);
+  } else if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+             cqe->res != -ECANCELED) {
+    fprintf(stderr, "Client read failed\n");
+    alive = false;
+  }
+  if (alive)
+    alive = ReadRequests(conn);
+  if (!alive)
+    CloseConnection(conn);
+}
+
+static void OnSend(struct Connection *conn, const struct io_uring_cqe *cqe) {
+  conn->ops--;
+  conn->send_busy = false;
+  if (conn->fd < 0) {
+    ReleaseConnection(conn);
+    return;
+  }
+  if (cqe->res < 0) {
+    fprintf(stderr, "Can't send data to client\n");
+    CloseConnection(conn);
+    return;
+  }
+  MetricAdd(METRIC_BYTES_OUT, (uint64_t)cqe->res);
+  conn->sending_sent += (size_t)cqe->res;
+  if (conn->sending_sent == conn->sending_len)
+    conn->sending_len = conn->sending_sent = 0;
+  StartSend(conn);
+  if (conn->eof && conn->inflight == 0 && !OutputPending(conn))
+    CloseConnection(conn);
+}
+
+// Runs on any thread; the eventfd pokes make sure every loop notices.
+static void OnStopSignal(int sig) {
+  uint64_t one = 1;
+  stopping = 1;
+  for (int i = 0; i < state.nloops; i++)
+    if (write(state.loops[i].done_fd, &one, sizeof(one)) < 0)
+      return;
+}
+
+static void CancelListener(uint64_t user_data) {
+  struct io_uring_sqe *sqe = QueueSqe(IORING_OP_ASYNC_CANCEL, -1, NULL,
+                                      OP_CANCEL);
+  sqe->addr = user_data;
+}
+
+// The io_uring event loop: accept, recv and the wakeups are multishot, so
+// a busy connection costs no syscall of its own. Everything queued while
+// handling one batch of completions goes out with the next wait.
+static int RunUring(void) {
+  const int listen_fds[] = {loop->tcp_fd, loop->unix_fd};
+  int listeners = 0;
+  for (int i = 0; i < 2; i++) {
+    if (listen_fds[i] >= 0) {
+      ArmAccept(listen_fds[i]);
+      listeners++;
+    }
+  }
+  ArmPoll(loop->done_fd, OP_DONE);
+  if (loop->admin_fd >= 0) {
+    ArmPoll(loop->admin_fd, OP_ADMIN);
+    listeners++;
+  }
+  if (loop->udp_fd >= 0) {
+    ArmPoll(loop->udp_fd, OP_UDP);
+    listeners++;
+  }
+
+  // The armed accepts and polls hold the listening sockets, and the
+  // kernel tears a ring down only after the process is gone, so they are
+  // cancelled first; otherwise a restart could not bind the port.
+  bool cancelled = false;
+  while (listeners > 0) {
+    if (stopping && !cancelled) {
+      for (int i = 0; i < 2; i++)
+        if (listen_fds[i] >= 0)
+          CancelListener(AcceptTag(listen_fds[i]));
+      if (loop->admin_fd >= 0)
+        CancelListener(OP_ADMIN);
+      if (loop->udp_fd >= 0)
+        CancelListener(OP_UDP);
+      cancelled = true;
+    }
+    if (UringSubmitAndWait(&loop->ring, 1) < 0 && errno != EINTR &&
+        errno != EBUSY) {
+      perror("io_uring_enter");
+      return 1;
+    }
+
+    struct io_uring_cqe *next;
+    while ((next = UringPeekCqe(&loop->ring)) != NULL) {
+      struct io_uring_cqe cqe = *next;
+      UringCqeSeen(&loop->ring);
+      struct Connection *conn =
+          (struct Connection *)(uintptr_t)(cqe.user_data & ~(uint64_t)OP_MASK);
+      bool more = cqe.flags & IORING_CQE_F_MORE;
+
+      switch (cqe.user_data & OP_MASK) {
+      case OP_ACCEPT:
+        if (cqe.res >= 0)
+          AddConnection(cqe.res);
+        else if (cqe.res != -ECANCELED)
+          fprintf(stderr, "Could not establish new connection\n");
+        if (!more && cancelled)
+          listeners--;
+        else if (!more)
+          ArmAccept((int)(cqe.user_data >> 3));
+        break;
+      case OP_RECV:
+        OnRecv(conn, &cqe);
+        break;
+      case OP_SEND:
+        OnSend(conn, &cqe);
+        break;
+      case OP_DONE:
+        DeliverReplies();
+        if (!more)
+          ArmPoll(loop->done_fd, OP_DONE);
+        break;
+      case OP_ADMIN:
+        if (cqe.res > 0)
+          ServeAdmin();
+        if (!more && cancelled)
+          listeners--;
+        else if (!more)
+          ArmPoll(loop->admin_fd, OP_ADMIN);
+        break;
+      case OP_UDP:
+        if (cqe.res > 0)
+          ReadDatagrams();
+        if (!more && cancelled)
+          listeners--;
+        else if (!more)
+          ArmPoll(loop->udp_fd, OP_UDP);
+        break;
+      }
+    }
+  }
+  for (int i = 0; i < 2; i++)
+    if (listen_fds[i] >= 0)
+      close(listen_fds[i]);
+  if (loop->unix_fd >= 0)
+    unlink(state.unix_path);
+  if (loop->admin_fd >= 0)
+    close(loop->admin_fd);
+  if (loop->udp_fd >= 0)
+    close(loop->udp_fd);
+  return 0;
+}
+
+static int RunEpoll(void) {
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("epoll_wait");
+      return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &loop->tcp_fd || ptr == &loop->unix_fd) {
+        AcceptConnections(*(int *)ptr);
+        continue;
+      }
+      if (ptr == &loop->done_fd) {
+        DeliverReplies();
+        continue;
+      }
+      if (ptr == &loop->admin_fd) {
+        ServeAdmin();
+        continue;
+      }
+      if (ptr == &loop->udp_fd) {
+        ReadDatagrams();
+        continue;
+      }
+
+      struct Connection *conn = ptr;
+      bool alive = true;
+      // EPOLLHUP means both directions are gone, not just a half-close.
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+        alive = false;
+      if (alive && (events[i].events & EPOLLOUT))
+        alive = FlushReplies(conn);
+      if (alive && (events[i].events & EPOLLIN))
+        alive = ReadRequests(conn);
+      else if (alive)
+        UpdateInterest(conn);
+      if (!alive)
+        CloseConnection(conn);
+    }
+  }
+  return 0;
+}
+
+static bool SetupRing(struct Uring *ring) {
+  if (UringInit(ring, URING_ENTRIES) &&
+      UringSetupBuffers(ring, 0, URING_BUFFERS, URING_BUFFER_SIZE))
+    return true;
+  int err = errno;
+  UringDestroy(ring);
+  errno = err;
+  return false;
+}
+
+static void *RunLoop(void *arg) {
+  loop = arg;
+  if (loop->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(loop->cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0)
+      fprintf(stderr, "Could not pin a loop to CPU %d: %s\n", loop->cpu,
+              strerror(err));
+  }
+  // SINGLE_ISSUER ties a ring to the thread that made it, so only the
+  // first loop's, which main uses to probe for io_uring, is made up front.
+  if (state.uring && loop != state.loops && !SetupRing(&loop->ring)) {
+    fprintf(stderr, "Could not set up io_uring: %s\n", strerror(errno));
+    close(loop->tcp_fd);
+    return (void *)(intptr_t)1;
+  }
+  int status = state.uring ? RunUring() : RunEpoll();
+  return (void *)(intptr_t)status;
+}
+
+// Everything but the listeners, which main opens first so that a busy port
+// fails before any thread starts, and the ring.
+static bool InitLoop(struct EventLoop *l) {
+  pthread_mutex_init(&l->done_lock, NULL);
+  l->done = NULL;
+  l->done_fd = eventfd(0, EFD_NONBLOCK);
+  if (l->done_fd < 0) {
+    fprintf(stderr, "Could not create the reply eventfd\n");
+    return false;
+  }
+  if (l->udp_fd >= 0) {
+    l->udp_conn = calloc(1, sizeof(struct Connection));
+    l->udp_seen = calloc(UDP_SEEN_SLOTS, sizeof(struct UdpSeen));
+    if (l->udp_conn == NULL || l->udp_seen == NULL) {
+      fprintf(stderr, "Could not allocate the UDP request table\n");
+      return false;
+    }
+    l->udp_conn->fd = l->udp_fd;
+    l->udp_conn->loop = l;
+  }
+  if (state.uring)
+    return true;
+
+  l->epoll_fd = epoll_create1(0);
+  if (l->epoll_fd < 0) {
+    fprintf(stderr, "Could not set up epoll\n");
+    return false;
+  }
+  // The listeners and the eventfd are told apart from connections by
+  // their data pointers, which never point at a struct Connection.
+  int *fds[] = {&l->tcp_fd, &l->unix_fd, &l->done_fd, &l->admin_fd,
+                &l->udp_fd};
+  for (int i = 0; i < 5; i++) {
+    if (*fds[i] < 0)
+      continue;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = fds[i]};
+    epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, *fds[i], &ev);
+  }
+  return true;
 }
 
 int main(int argc, char **argv) {
   int tnum = -1;
   int port = -1;
+  enum FactAlgo algo = FACT_ALGO_AUTO;
+  const char *ckpt_dir = NULL;
+  size_t cache_mb = 16;
+  int admin_port = -1;
+  bool verbose = false;
+  bool uring = false;
+  const char *unix_path = NULL;
+  int nloops = 1;
+  bool pin = false;
+  uint64_t max_queue = 0;
+  bool udp = false;
 
   while (true) {
     int current_optind = optind ? optind : 1;
 
     static struct option options[] = {{"port", required_argument, 0, 0},
                                       {"tnum", required_argument, 0, 0},
+                                      {"algo", required_argument, 0, 0},
+                                      {"ckpt", required_argument, 0, 0},
+                                      {"cache-mb", required_argument, 0, 0},
+                                      {"admin-port", required_argument, 0, 0},
+                                      {"verbose", no_argument, 0, 0},
+                                      {"io", required_argument, 0, 0},
+                                      {"unix", required_argument, 0, 0},
+                                      {"loops", required_argument, 0, 0},
+                                      {"pin", no_argument, 0, 0},
+                                      {"max-queue", required_argument, 0, 0},
+                                      {"udp", no_argument, 0, 0},
                                       {0, 0, 0, 0}};
 
     int option_index = 0;
@@ -67,11 +1481,76 @@ int main(int argc, char **argv) {
       switch (option_index) {
       case 0:
         port = atoi(optarg);
-        // TODO: your code here
+        if (port <= 0 || port > 65535) {
+          fprintf(stderr, "port must be in 1..65535\n");
+          return 1;
+        }
         break;
       case 1:
         tnum = atoi(optarg);
-        // TODO: your code here
+        if (tnum <= 0) {
+          fprintf(stderr, "tnum must be a positive number\n");
+          return 1;
+        }
+        break;
+      case 2:
+        if (!ParseFactAlgo(optarg, &algo)) {
+          fprintf(stderr, "algo must be auto, linear or fast\n");
+          return 1;
+        }
+        break;
+      case 3:
+        ckpt_dir = optarg;
+        break;
+      case 4: {
+        uint64_t mb = 0;
+        if (!ConvertStringToUI64(optarg, &mb) || mb > SIZE_MAX >> 20) {
+          fprintf(stderr, "cache-mb must be a number of megabytes\n");
+          return 1;
+        }
+        cache_mb = (size_t)mb;
+      } break;
+      case 5:
+        admin_port = atoi(optarg);
+        if (admin_port <= 0 || admin_port > 65535) {
+          fprintf(stderr, "admin-port must be in 1..65535\n");
+          return 1;
+        }
+        break;
+      case 6:
+        verbose = true;
+        break;
+      case 7:
+        if (strcmp(optarg, "epoll") == 0) {
+          uring = false;
+        } else if (strcmp(optarg, "uring") == 0) {
+          uring = true;
+        } else {
+          fprintf(stderr, "io must be epoll or uring\n");
+          return 1;
+        }
+        break;
+      case 8:
+        unix_path = optarg;
+        break;
+      case 9:
+        nloops = atoi(optarg);
+        if (nloops < 0) {
+          fprintf(stderr, "loops must be a number, 0 for one per CPU\n");
+          return 1;
+        }
+        break;
+      case 10:
+        pin = true;
+        break;
+      case 11:
+        if (!ConvertStringToUI64(optarg, &max_queue)) {
+          fprintf(stderr, "max-queue must be a number of terms\n");
+          return 1;
+        }
+        break;
+      case 12:
+        udp = true;
         break;
       default:
         printf("Index %d is out of options\n", option_index);
@@ -86,111 +1565,119 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (port == -1 || tnum == -1) {
-    fprintf(stderr, "Using: %s --port 20001 --tnum 4\n", argv[0]);
+  if ((port == -1 && unix_path == NULL) || tnum == -1) {
+    fprintf(stderr, "Using: %s --port 20001 --tnum 4 [--algo auto] [--ckpt dir] "
+                    "[--cache-mb 16] [--admin-port 20101] [--verbose] "
+                    "[--io epoll] [--unix /path] [--loops 1] [--pin] "
+                    "[--max-queue 0] [--udp]\n",
+            argv[0]);
+    fprintf(stderr, "       --unix listens on a Unix socket as well, or "
+                    "instead when --port is left out\n");
+    fprintf(stderr, "       --admin-port serves counters and latency "
+                    "percentiles as plain text to every connection\n");
+    fprintf(stderr, "       --io uring batches socket I/O through io_uring "
+                    "(Linux 6.0+, falls back to epoll)\n");
+    fprintf(stderr, "       --loops runs that many accept and event loops on "
+                    "one port, 0 for one per CPU; --pin binds each to a "
+                    "CPU\n");
+    fprintf(stderr, "       --max-queue answers busy to requests past that "
+                    "many terms waiting or computing, 0 for no limit\n");
+    fprintf(stderr, "       --udp also answers one-frame datagrams on "
+                    "--port\n");
     return 1;
   }
-
-  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
-    fprintf(stderr, "Can not create server socket!");
+  if (udp && port == -1) {
+    fprintf(stderr, "--udp needs a --port\n");
     return 1;
   }
 
-  struct sockaddr_in server;
-  server.sin_family = AF_INET;
-  server.sin_port = htons((uint16_t)port);
-  server.sin_addr.s_addr = htonl(INADDR_ANY);
+  int ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus <= 0)
+    ncpus = 1;
+  if (nloops == 0)
+    nloops = ncpus;
+  if (nloops > 1 && port <= 0)
+    nloops = 1; // the Unix socket has no SO_REUSEPORT to split accepts
 
-  int opt_val = 1;
-  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val));
+  state.loops = calloc(nloops, sizeof(struct EventLoop));
+  state.nloops = nloops;
+  state.unix_path = unix_path;
+  for (int i = 0; i < nloops; i++) {
+    struct EventLoop *l = &state.loops[i];
+    l->cpu = pin ? i % ncpus : -1;
+    l->tcp_fd = port > 0 ? OpenListener(port, nloops > 1) : -1;
+    l->unix_fd = i == 0 && unix_path != NULL ? OpenUnixListener(unix_path) : -1;
+    l->admin_fd = i == 0 && admin_port > 0 ? OpenListener(admin_port, false)
+                                           : -1;
+    l->udp_fd = udp ? OpenUdpSocket(port, nloops > 1) : -1;
+    if ((port > 0 && l->tcp_fd < 0) ||
+        (i == 0 && unix_path != NULL && l->unix_fd < 0) ||
+        (i == 0 && admin_port > 0 && l->admin_fd < 0) ||
+        (udp && l->udp_fd < 0))
+      return 1;
+  }
 
-  int err = bind(server_fd, (struct sockaddr *)&server, sizeof(server));
-  if (err < 0) {
-    fprintf(stderr, "Can not bind to socket!");
+  state.tnum = tnum;
+  state.verbose = verbose;
+  state.max_queued = max_queue;
+  state.algo = algo;
+  state.ckpt_dir = ckpt_dir;
+  if (!CacheInit(&state.cache, cache_mb << 20)) {
+    fprintf(stderr, "Could not allocate a %zu MB result cache\n", cache_mb);
     return 1;
   }
-
-  err = listen(server_fd, 128);
-  if (err < 0) {
-    fprintf(stderr, "Could not listen on socket\n");
+  if (!PoolInit(&state.compute, tnum) ||
+      !PoolInit(&state.requests, tnum + 1)) {
+    fprintf(stderr, "Could not start %d workers\n", tnum);
     return 1;
   }
+  state.requests.max_running[POOL_LANE_LARGE] = tnum;
+  state.compute.max_wait_ns = state.requests.max_wait_ns =
+      MAX_LANE_WAIT_MS * 1000000ull;
 
-  printf("Server listening at %d\n", port);
-
-  while (true) {
-    struct sockaddr_in client;
-    socklen_t client_len = sizeof(client);
-    int client_fd = accept(server_fd, (struct sockaddr *)&client, &client_len);
-
-    if (client_fd < 0) {
-      fprintf(stderr, "Could not establish new connection\n");
-      continue;
-    }
-
-    while (true) {
-      unsigned int buffer_size = sizeof(uint64_t) * 3;
-      char from_client[buffer_size];
-      int read = recv(client_fd, from_client, buffer_size, 0);
-
-      if (!read)
-        break;
-      if (read < 0) {
-        fprintf(stderr, "Client read failed\n");
-        break;
-      }
-      if (read < buffer_size) {
-        fprintf(stderr, "Client send wrong data format\n");
-        break;
-      }
-
-      pthread_t threads[tnum];
-
-      uint64_t begin = 0;
-      uint64_t end = 0;
-      uint64_t mod = 0;
-      memcpy(&begin, from_client, sizeof(uint64_t));
-      memcpy(&end, from_client + sizeof(uint64_t), sizeof(uint64_t));
-      memcpy(&mod, from_client + 2 * sizeof(uint64_t), sizeof(uint64_t));
-
-      fprintf(stdout, "Receive: %llu %llu %llu\n", begin, end, mod);
-
-      struct FactorialArgs args[tnum];
-      for (uint32_t i = 0; i < tnum; i++) {
-        // TODO: parallel somehow
-        args[i].begin = 1;
-        args[i].end = 1;
-        args[i].mod = mod;
-
-        if (pthread_create(&threads[i], NULL, ThreadFactorial,
-                           (void *)&args[i])) {
-          printf("Error: pthread_create failed!\n");
-          return 1;
-        }
-      }
+  if (uring) {
+    state.uring = SetupRing(&state.loops[0].ring);
+    if (!state.uring)
+      fprintf(stderr, "io_uring unavailable (%s), using epoll\n",
+              strerror(errno));
+  }
+  for (int i = 0; i < nloops; i++)
+    if (!InitLoop(&state.loops[i]))
+      return 1;
 
-      uint64_t total = 1;
-      for (uint32_t i = 0; i < tnum; i++) {
-        uint64_t result = 0;
-        pthread_join(threads[i], (void **)&result);
-        total = MultModulo(total, result, mod);
-      }
+  if (state.uring) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnStopSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+  }
 
-      printf("Total: %llu\n", total);
+  const char *backend = state.uring ? "io_uring" : "epoll";
+  if (port > 0)
+    printf("Server listening at %d (%s, %d loops%s)\n", port, backend, nloops,
+           pin ? ", pinned" : "");
+  if (unix_path != NULL)
+    printf("Server listening at unix:%s (%s)\n", unix_path, backend);
+  if (udp)
+    printf("Server answering datagrams at %d (%s)\n", port, backend);
+  if (admin_port > 0)
+    printf("Metrics at %d\n", admin_port);
+  fflush(stdout);
 
-      char buffer[sizeof(total)];
-      memcpy(buffer, &total, sizeof(total));
-      err = send(client_fd, buffer, sizeof(total), 0);
-      if (err < 0) {
-        fprintf(stderr, "Can't send data to client\n");
-        break;
-      }
+  for (int i = 1; i < nloops; i++) {
+    if (pthread_create(&state.loops[i].thread, NULL, RunLoop,
+                       &state.loops[i]) != 0) {
+      fprintf(stderr, "Could not start event loop %d\n", i);
+      return 1;
     }
-
-    shutdown(client_fd, SHUT_RDWR);
-    close(client_fd);
   }
-
-  return 0;
+  int status = (int)(intptr_t)RunLoop(&state.loops[0]);
+  for (int i = 1; i < nloops; i++) {
+    void *loop_status;
+    pthread_join(state.loops[i].thread, &loop_status);
+    if ((intptr_t)loop_status != 0)
+      status = 1;
+  }
+  return status;
 }
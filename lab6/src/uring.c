@@ -0,0 +1,164 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int Setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int Enter(int fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int Register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool UringInit(struct Uring *ring, unsigned entries) {
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  // SINGLE_ISSUER arrived together with multishot recv in 6.0, so an
+  // older kernel rejects the setup here rather than a recv later on.
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN |
+            IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 4;
+  ring->fd = Setup(entries, &p);
+  if (ring->fd < 0)
+    return false;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    UringDestroy(ring);
+    errno = ENOSYS;
+    return false;
+  }
+
+  ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > ring->sq_map_size)
+    ring->sq_map_size = cq_size;
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    UringDestroy(ring);
+    return false;
+  }
+  ring->cq_map = ring->sq_map;
+
+  char *sq = ring->sq_map;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(sq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(sq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+  return true;
+}
+
+void UringDestroy(struct Uring *ring) {
+  if (ring->buf_ring != NULL)
+    munmap(ring->buf_ring, ring->nbufs * sizeof(struct io_uring_buf));
+  free(ring->bufs);
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+    munmap(ring->sq_map, ring->sq_map_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+bool UringSetupBuffers(struct Uring *ring, uint16_t bgid, unsigned nbufs,
+                       unsigned buf_size) {
+  size_t ring_size = nbufs * sizeof(struct io_uring_buf);
+  void *map = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return false;
+  ring->buf_ring = map;
+  ring->nbufs = nbufs;
+  ring->buf_size = buf_size;
+  ring->bgid = bgid;
+  ring->bufs = malloc((size_t)nbufs * buf_size);
+  if (ring->bufs == NULL)
+    return false;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)map;
+  reg.ring_entries = nbufs;
+  reg.bgid = bgid;
+  if (Register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return false;
+
+  for (unsigned i = 0; i < nbufs; i++)
+    UringRecycleBuffer(ring, (uint16_t)i);
+  return true;
+}
+
+char *UringBuffer(struct Uring *ring, uint16_t bid) {
+  return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+void UringRecycleBuffer(struct Uring *ring, uint16_t bid) {
+  struct io_uring_buf *buf =
+      &ring->buf_ring->bufs[ring->buf_tail & (ring->nbufs - 1)];
+  buf->addr = (uint64_t)(uintptr_t)UringBuffer(ring, bid);
+  buf->len = ring->buf_size;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *UringGetSqe(struct Uring *ring) {
+  if (ring->sq_local_tail -
+          __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+      ring->sq_entries)
+    UringSubmitAndWait(ring, 0);
+  unsigned index = ring->sq_local_tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->sq_local_tail++;
+  return sqe;
+}
+
+int UringSubmitAndWait(struct Uring *ring, unsigned wait_nr) {
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  // Counted from the kernel's head, so SQEs left behind by an interrupted
+  // call go in with this one.
+  unsigned to_submit =
+      ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (to_submit == 0 && wait_nr == 0)
+    return 0;
+  return Enter(ring->fd, to_submit, wait_nr,
+               wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+}
+
+struct io_uring_cqe *UringPeekCqe(struct Uring *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void UringCqeSeen(struct Uring *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,53 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal io_uring over the raw syscalls, enough for a socket server:
+// one submission/completion ring pair plus one ring of provided receive
+// buffers that multishot recv picks from.
+struct Uring {
+  int fd;
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_local_tail; // queued but not yet handed to the kernel
+
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  unsigned nbufs, buf_size;
+  uint16_t buf_tail;
+  uint16_t bgid;
+};
+
+// Fails (errno set) on kernels without multishot recv (before 6.0), or if
+// io_uring is disabled; callers fall back to epoll.
+bool UringInit(struct Uring *ring, unsigned entries);
+void UringDestroy(struct Uring *ring);
+
+// Registers nbufs buffers of buf_size bytes as buffer group bgid.
+// nbufs must be a power of two.
+bool UringSetupBuffers(struct Uring *ring, uint16_t bgid, unsigned nbufs,
+                       unsigned buf_size);
+char *UringBuffer(struct Uring *ring, uint16_t bid);
+// Hands a provided buffer back to the kernel once its data is consumed.
+void UringRecycleBuffer(struct Uring *ring, uint16_t bid);
+
+// A zeroed SQE to fill in. Submits the queue first if it is full.
+struct io_uring_sqe *UringGetSqe(struct Uring *ring);
+// Hands every queued SQE to the kernel and waits for at least wait_nr
+// completions, in one syscall. Fails with EINTR if a signal arrives.
+int UringSubmitAndWait(struct Uring *ring, unsigned wait_nr);
+
+// The oldest unseen completion, or NULL. Call UringCqeSeen after each.
+struct io_uring_cqe *UringPeekCqe(struct Uring *ring);
+void UringCqeSeen(struct Uring *ring);
+
+#endif
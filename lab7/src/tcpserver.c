@@ -1,62 +1,277 @@
+#define _GNU_SOURCE // splice, accept4, F_SETPIPE_SZ
 #include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define SERV_PORT 10050
-#define BUFSIZE 100
+#define BUFSIZE 65536
+#define MAX_EVENTS 64
 #define SADDR struct sockaddr
 
-int main() {
+// Where every client's bytes end up. Data goes socket -> pipe -> out with
+// splice, so it is never copied into this process; outputs splice can not
+// write to (a terminal, a file opened for append) fall back to read/write.
+struct Sink {
+  int out;
+  int pipe[2];
+  bool copy;
+  char *buf; // copy mode only
+  size_t bufsize;
+};
+
+// Totals since the first of the currently connected clients arrived.
+struct Ingest {
+  int active;
+  int clients;
+  uint64_t bytes;
+  struct timespec start;
+};
+
+static double Seconds(const struct timespec *from) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static bool WriteAll(int fd, const char *buf, size_t n) {
+  while (n > 0) {
+    ssize_t written = write(fd, buf, n);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      return false;
+    buf += written;
+    n -= (size_t)written;
+  }
+  return true;
+}
+
+// Moves the n bytes in the pipe to the output, leaving the pipe empty.
+static bool Drain(struct Sink *sink, size_t n) {
+  while (n > 0 && !sink->copy) {
+    ssize_t moved = splice(sink->pipe[0], NULL, sink->out, NULL, n,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (moved < 0 && errno == EINTR)
+      continue;
+    if (moved < 0 && errno == EINVAL) {
+      sink->copy = true;
+      break;
+    }
+    if (moved <= 0)
+      return false;
+    n -= (size_t)moved;
+  }
+  while (n > 0) {
+    ssize_t nread = read(sink->pipe[0], sink->buf, n < sink->bufsize
+                                                       ? n
+                                                       : sink->bufsize);
+    if (nread <= 0 || !WriteAll(sink->out, sink->buf, (size_t)nread))
+      return false;
+    n -= (size_t)nread;
+  }
+  return true;
+}
+
+// Takes up to bufsize bytes from the client into the output. Returns what
+// read would: the byte count, 0 at end of stream, -1 with errno set.
+static ssize_t Receive(struct Sink *sink, int fd) {
+  if (sink->copy) {
+    ssize_t nread = read(fd, sink->buf, sink->bufsize);
+    if (nread > 0 && !WriteAll(sink->out, sink->buf, (size_t)nread)) {
+      perror("write");
+      exit(1);
+    }
+    return nread;
+  }
+  ssize_t nread = splice(fd, NULL, sink->pipe[1], NULL, sink->bufsize,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (nread > 0 && !Drain(sink, (size_t)nread)) {
+    perror("splice");
+    exit(1);
+  }
+  return nread;
+}
+
+static bool OpenSink(struct Sink *sink, const char *path, size_t bufsize) {
+  sink->out = 1;
+  if (path != NULL &&
+      (sink->out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror(path);
+    return false;
+  }
+  if (pipe(sink->pipe) < 0) {
+    perror("pipe");
+    return false;
+  }
+  // A splice moves at most what the pipe holds, so the pipe is sized to the
+  // buffer, or as close as the system allows.
+  fcntl(sink->pipe[1], F_SETPIPE_SZ, (int)bufsize);
+  int pipe_size = fcntl(sink->pipe[1], F_GETPIPE_SZ);
+  sink->bufsize = pipe_size > 0 && (size_t)pipe_size < bufsize
+                      ? (size_t)pipe_size
+                      : bufsize;
+  sink->buf = malloc(sink->bufsize);
+  sink->copy = false;
+  return sink->buf != NULL;
+}
+
+static void AcceptClients(int lfd, int epfd, struct Ingest *ingest) {
+  while (true) {
+    struct sockaddr_in cliaddr;
+    socklen_t clilen = sizeof(cliaddr);
+    int cfd = accept4(lfd, (SADDR *)&cliaddr, &clilen, SOCK_NONBLOCK);
+    if (cfd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("accept");
+      return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = cfd};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+      perror("epoll_ctl");
+      close(cfd);
+      continue;
+    }
+    if (ingest->active++ == 0) {
+      ingest->clients = 0;
+      ingest->bytes = 0;
+      clock_gettime(CLOCK_MONOTONIC, &ingest->start);
+    }
+    ingest->clients++;
+    fprintf(stderr, "connection established\n");
+  }
+}
+
+static void CloseClient(int cfd, struct Ingest *ingest) {
+  close(cfd);
+  if (--ingest->active > 0)
+    return;
+  double seconds = Seconds(&ingest->start);
+  fprintf(stderr, "%d clients sent %llu bytes in %.3f s: %.1f MB/s\n",
+          ingest->clients, (unsigned long long)ingest->bytes, seconds,
+          seconds > 0 ? ingest->bytes / seconds / 1e6 : 0);
+}
+
+int main(int argc, char **argv) {
   const size_t kSize = sizeof(struct sockaddr_in);
 
-  int lfd, cfd;
-  int nread;
-  char buf[BUFSIZE];
+  int port = SERV_PORT;
+  long bufsize = BUFSIZE;
+  const char *output = NULL;
+
+  while (true) {
+    static struct option options[] = {{"port", required_argument, 0, 0},
+                                      {"bufsize", required_argument, 0, 0},
+                                      {"output", required_argument, 0, 0},
+                                      {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0:
+      switch (option_index) {
+      case 0:
+        port = atoi(optarg);
+        if (port <= 0 || port > 65535) {
+          fprintf(stderr, "port must be between 1 and 65535\n");
+          return 1;
+        }
+        break;
+      case 1:
+        bufsize = atol(optarg);
+        if (bufsize <= 0 || bufsize > INT32_MAX) {
+          fprintf(stderr, "bufsize must be a positive number\n");
+          return 1;
+        }
+        break;
+      case 2:
+        output = optarg;
+        break;
+      }
+      break;
+    case '?':
+      fprintf(stderr,
+              "Usage: %s [--port 10050] [--bufsize 65536] [--output file]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  struct Sink sink;
+  if (!OpenSink(&sink, output, (size_t)bufsize))
+    exit(1);
+
+  int lfd;
   struct sockaddr_in servaddr;
-  struct sockaddr_in cliaddr;
 
-  if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+  if ((lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
     perror("socket");
     exit(1);
   }
+  int one = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
   memset(&servaddr, 0, kSize);
   servaddr.sin_family = AF_INET;
   servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  servaddr.sin_port = htons(SERV_PORT);
+  servaddr.sin_port = htons(port);
 
   if (bind(lfd, (SADDR *)&servaddr, kSize) < 0) {
     perror("bind");
     exit(1);
   }
 
-  if (listen(lfd, 5) < 0) {
+  if (listen(lfd, SOMAXCONN) < 0) {
     perror("listen");
     exit(1);
   }
 
-  while (1) {
-    unsigned int clilen = kSize;
+  int epfd = epoll_create1(0);
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = lfd};
+  if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) < 0) {
+    perror("epoll");
+    exit(1);
+  }
 
-    if ((cfd = accept(lfd, (SADDR *)&cliaddr, &clilen)) < 0) {
-      perror("accept");
+  // One splice per ready client per round, so a fast sender can not starve
+  // the others.
+  struct Ingest ingest = {0};
+  struct epoll_event events[MAX_EVENTS];
+  while (1) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
       exit(1);
     }
-    printf("connection established\n");
-
-    while ((nread = read(cfd, buf, BUFSIZE)) > 0) {
-      write(1, &buf, nread);
-    }
-
-    if (nread == -1) {
-      perror("read");
-      exit(1);
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == lfd) {
+        AcceptClients(lfd, epfd, &ingest);
+        continue;
+      }
+      ssize_t nread = Receive(&sink, fd);
+      if (nread > 0) {
+        ingest.bytes += (uint64_t)nread;
+      } else if (nread == 0 || (errno != EAGAIN && errno != EINTR)) {
+        if (nread < 0)
+          perror("read");
+        CloseClient(fd, &ingest);
+      }
     }
-    close(cfd);
   }
 }